@@ -1,4 +1,14 @@
 var xapian = require('./xapian-binding');
+var assert = require('assert');
+var fs = require('fs');
+var util = require('util');
+
+// settings read by pool threads go before the first async op
+xapian.set_max_changesets(10);
+xapian.set_pool_options({threads:4});
+xapian.set_handle_cache(64);
+xapian.set_document_cache(1<<20, [4]);
+xapian.set_memory_limit(64<<20);
 
 var aDocs = [
   {data:'doc one',   text:['text one two three four five six'],    terms:{max:1},         values:{1:'stuff'}, id_term:'#dk83ndj'},
@@ -87,10 +97,328 @@ function fRead() {
           m2t.convert('mime-test.html', null, function(err, result) {
             if (err) throw err;
             console.log(result.title+' '+result.body);
+            fFeatures();
+          });
+        }
+      });
+    });
+  });
+}
+
+
+
+// the rest checks each feature added beyond the Xapian API, in order
+
+var aRiver = [
+  {id_term:'Qriver1', text:'The river runs past the mill, where the wheel turns all day.', values:{3:'north', 4:1, 7:'a'},
+   fields:{title:{prefix:'S', weight:2, text:'River Mill'}}},
+  {id_term:'Qriver2', text:'A river feeds the mill pond.',                                values:{3:'north', 4:2, 7:'a'}},
+  {id_term:'Qriver3', text:'River boats wait on the canal.',                              values:{3:'south', 4:3, 7:'b'}},
+  {id_term:'Qriver4', text:'The canal meets the river at the lock.',                      values:{3:'south', 4:4, 7:'b'}, terms:{XDROP:1}},
+  {id_term:'Qriver5', text:'River & lock <keepers>',                                      values:{3:'east', 4:new Date(2012, 0, 1), 7:'c'}, terms:{XDROP:1}},
+  {id_term:'Qriver6', text:'Ships',                                                       values:{3:'east', 4:6, 7:'c'}}
+];
+var atg2 = new xapian.TermGenerator;
+var stem2 = new xapian.Stem('english');
+atg2.set_stemmer(stem2);
+var wdb3, replica;
+
+var aSteps = [ fWriteReplicated, fSearch, fCollapse, fBatches, fSimilar, fCancel, fDelete, fWarm, fCompact, fInMemory,
+               fIndexDirectory, fConvertChunks, fStats ];
+function fFeatures() {
+  var aStep = aSteps.shift();
+  if (aStep) {
+    console.log('-- '+aStep.name.slice(1));
+    aStep(fFeatures);
+    return;
+  }
+  console.log('all checks passed');
+}
+
+// counts matches of query in the database at path
+function fCount(path, query, next) {
+  var db = new xapian.Database(path);
+  db.on('open', function(err) {
+    if (err) throw err;
+    var enq = new xapian.Enquire(db);
+    enq.set_query(query);
+    enq.get_mset(0, 100, function(err, mset) {
+      if (err) throw err;
+      next(mset.length);
+    });
+  });
+}
+
+var aRiverQuery = new xapian.Query(xapian.Query.OP_OR, 'river', 'ships');
+
+// replace_document and commit on db3, with changesets published to the replica db3r
+function fWriteReplicated(next) {
+  wdb3 = new xapian.WritableDatabase('db3', xapian.DB_CREATE_OR_OVERWRITE);
+  wdb3.on('open', function(err) {
+    if (err) throw err;
+    replica = new xapian.DatabaseReplica('db3r');
+    replica.on('open', function(err) {
+      if (err) throw err;
+      wdb3.add_replica(replica);
+      atg2.set_database(wdb3);
+      fAdd(0);
+    });
+  });
+  function fAdd(n) {
+    if (n < aRiver.length) {
+      var aIn = {id_term:aRiver[n].id_term, data:aRiver[n].text, text:[aRiver[n].text]};
+      ['values', 'terms', 'fields'].forEach(function(k) { if (k in aRiver[n]) aIn[k] = aRiver[n][k]; });
+      xapian.assemble_document(atg2, m2t, aIn, function(err, doc) {
+        if (err) throw err;
+        wdb3.replace_document(aRiver[n].id_term, doc, function(err) {
+          if (err) throw err;
+          fAdd(++n);
+        });
+      });
+      return;
+    }
+    replica.once('applied', function(err, info) {
+      if (err) throw err;
+      assert.ok(info.changeset_count + info.fullcopy_count > 0);
+      fCount('db3r', aRiverQuery, function(count) {
+        assert.equal(count, aRiver.length);
+        console.log('replica has '+count+' documents');
+        next();
+      });
+    });
+    wdb3.commit(function(err) {
+      if (err) throw err;
+    });
+  }
+}
+
+// open_databases, facets, snippets, prefetch, Buffer values, value ranges and coalesced calls
+var combined;
+function fSearch(next) {
+  xapian.open_databases(['db1', 'db2', 'db3'], function(err, db) {
+    if (err) throw err;
+    combined = db;
+    var enq = new xapian.Enquire(combined);
+    enq.set_query(aRiverQuery);
+    var aOpts = {check_at_least:100, facets:{3:0}, snippet:{length:40, stem:stem2}, prefetch:true};
+    var aPending = 2, aIds = [];
+    for (var a = 0; a < 2; ++a) // identical calls in flight at once share one match
+      enq.get_mset(0, 10, aOpts, fResult);
+    function fResult(err, mset, info) {
+      if (err) throw err;
+      assert.equal(mset.length, aRiver.length);
+      aIds.push(mset.map(function(item) { return item.id; }).join());
+      if (--aPending)
+        return;
+      assert.equal(aIds[0], aIds[1]);
+      var aTotal = 0;
+      info.facets[3].values.forEach(function(v) {
+        assert.ok(Buffer.isBuffer(v.value));
+        aTotal += v.count;
+      });
+      assert.equal(aTotal, aRiver.length);
+      console.log('facets '+util.inspect(info.facets[3].values.map(function(v) { return v.value.toString()+':'+v.count; })));
+      assert.ok(xapian.document_cache_stats().entries > 0);
+      var aFound = false;
+      mset.forEach(function(item) {
+        assert.ok(/<b>/.test(item.snippet));
+        assert.ok(item.snippet.length < 40 + 3*3 + 7*4); // length, omits, markup
+        if (/keepers/.test(item.snippet)) {
+          assert.ok(/&amp;/.test(item.snippet) && /&lt;keepers&gt;/.test(item.snippet));
+          aFound = true;
+          item.document.get_values(function(err, values) {
+            if (err) throw err;
+            assert.ok(Buffer.isBuffer(values[4]));
+            assert.equal(xapian.sortable_unserialise(values[4]), new Date(2012, 0, 1).getTime());
+            console.log('snippet '+item.snippet);
+            fRange();
           });
         }
       });
+      assert.ok(aFound);
+    }
+  });
+  function fRange() {
+    var enq = new xapian.Enquire(combined);
+    enq.set_query(new xapian.Query(xapian.Query.OP_VALUE_RANGE, 4, 2, 3));
+    enq.get_mset(0, 10, function(err, mset) {
+      if (err) throw err;
+      assert.equal(mset.length, 2);
+      next();
     });
+  }
+}
+
+function fCollapse(next) {
+  var enq = new xapian.Enquire(combined);
+  enq.set_query(aRiverQuery);
+  enq.set_collapse_key(7);
+  enq.get_mset(0, 10, function(err, mset) {
+    if (err) throw err;
+    var aKeys = mset.map(function(item) { return item.collapse_key.toString(); }).sort();
+    assert.deepEqual(aKeys, ['a', 'b', 'c']);
+    mset.forEach(function(item) { assert.equal(item.collapse_count, 1); });
+    console.log('collapsed to '+mset.length);
+    next();
   });
 }
 
+function fBatches(next) {
+  var enq = new xapian.Enquire(combined);
+  enq.set_query(aRiverQuery);
+  var aSizes = [];
+  enq.get_mset(0, 10, {batch_size:4, tick_budget:2}, function(err, mset, info) {
+    if (err) throw err;
+    aSizes.push(mset.length);
+    if (info.more)
+      return;
+    assert.deepEqual(aSizes, [4, 2]);
+    console.log('batches '+aSizes);
+    next();
+  });
+}
+
+function fSimilar(next) {
+  var enq = new xapian.Enquire(combined);
+  enq.set_query(aRiverQuery);
+  enq.get_mset(0, 1, function(err, mset) {
+    if (err) throw err;
+    var aId = mset[0].id;
+    enq.similar([aId], {max:5, terms:10, elite:5}, function(err, list, info) {
+      if (err) throw err;
+      assert.ok(Array.isArray(info.terms) && info.terms.length > 0);
+      list.forEach(function(item) { assert.notEqual(item.id, aId); });
+      console.log('similar to '+aId+': '+list.length+' via '+info.terms);
+      next();
+    });
+  });
+}
+
+function fCancel(next) {
+  var enq = new xapian.Enquire(combined);
+  enq.set_query(aRiverQuery);
+  var aCalled = false;
+  var aHandle = enq.get_mset(0, 10, {cancellable:true}, function(err, mset) {
+    aCalled = true;
+  });
+  aHandle.cancel();
+  setTimeout(function() {
+    assert.ok(!aCalled);
+    next();
+  }, 200);
+}
+
+// by id term, then by Query in a transaction
+function fDelete(next) {
+  wdb3.delete_documents(['Qriver6'], function(err, count) {
+    if (err) throw err;
+    assert.equal(count, 1);
+    wdb3.delete_documents(new xapian.Query(xapian.Query.OP_OR, 'XDROP'), {transaction:true}, function(err, count) {
+      if (err) throw err;
+      assert.equal(count, 2);
+      replica.once('applied', function(err, info) {
+        if (err) throw err;
+        fCount('db3r', aRiverQuery, function(count) {
+          assert.equal(count, 3);
+          console.log('deleted 3');
+          next();
+        });
+      });
+      wdb3.commit(function(err) {
+        if (err) throw err;
+      });
+    });
+  });
+}
+
+function fWarm(next) {
+  var db = new xapian.Database('db3');
+  db.on('open', function(err) {
+    if (err) throw err;
+    db.warm({top_terms:5}, function(err, result) {
+      if (err) throw err;
+      assert.ok(result.files > 0);
+      console.log('warmed '+util.inspect(result));
+      next();
+    });
+  });
+}
+
+function fCompact(next) {
+  xapian.compact(['db3'], 'db3c', {compaction:xapian.compact.FULL, open:true}, function(err, db) {
+    if (err) throw err;
+    var enq = new xapian.Enquire(db);
+    enq.set_query(aRiverQuery);
+    enq.get_mset(0, 10, function(err, mset) {
+      if (err) throw err;
+      assert.equal(mset.length, 3);
+      next();
+    });
+  });
+}
+
+// an InMemory copy of db3, written back to disk by snapshot()
+function fInMemory(next) {
+  var db = new xapian.Database('db3', {inmemory:true});
+  db.on('open', function(err) {
+    if (err) throw err;
+    db.snapshot('db3s', function(err) {
+      if (err) throw err;
+      fCount('db3s', aRiverQuery, function(count) {
+        assert.equal(count, 3);
+        next();
+      });
+    });
+  });
+}
+
+function fIndexDirectory(next) {
+  try { fs.mkdirSync('idx-test', 0755); } catch (e) { if (e.code !== 'EEXIST') throw e; }
+  fs.writeFileSync('idx-test/mime-test.html', fs.readFileSync('mime-test.html'));
+  fs.writeFileSync('idx-test/notes.txt', 'Notes on the river lock.\n');
+  var wdb = new xapian.WritableDatabase(null, xapian.DB_CREATE_OR_OVERWRITE); // empty InMemory
+  wdb.on('open', function(err) {
+    if (err) throw err;
+    fRun(function(summary) {
+      assert.equal(summary.indexed, 2);
+      fRun(function(summary) {
+        assert.equal(summary.unchanged, 2);
+        next();
+      });
+    });
+  });
+  function fRun(done) {
+    wdb.index_directory(atg2, m2t, 'idx-test', {md5_slot:2, batch_size:10, progress:function(p) {}}, function(err, summary) {
+      if (err) throw err;
+      assert.equal(summary.failed, 0, summary.errors.join('\n'));
+      console.log('index_directory '+util.inspect(summary));
+      done(summary);
+    });
+    assert.throws(function() { atg2.set_flags(0); }, /busy/); // the crawl holds atg2
+  }
+}
+
+function fConvertChunks(next) {
+  m2t.convert('mime-test.html', null, function(err, whole) {
+    if (err) throw err;
+    var aBody = '', aParts = 0;
+    m2t.convert('mime-test.html', null, {body_chunk:16}, function(err, part, more) {
+      if (err) throw err;
+      aBody += part.body;
+      ++aParts;
+      if (more)
+        return;
+      assert.equal(aBody, whole.body);
+      console.log('body in '+aParts+' parts');
+      next();
+    });
+  });
+}
+
+function fStats(next) {
+  console.log('memory '+util.inspect(xapian.memory_stats()));
+  console.log('pool '+util.inspect(xapian.pool_stats()));
+  console.log('document cache '+util.inspect(xapian.document_cache_stats()));
+  wdb3 = replica = combined = null;
+  next();
+}
@@ -7,38 +7,728 @@
 #include <node_events.h>
 #include <node_buffer.h>
 
+#include <set>
+#include <map>
+#include <algorithm>
+#include <list>
+#include <queue>
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+// in libmime2text.a, from Omega's md5wrap.h
+bool md5_file(const std::string& file_name, std::string& md5, bool try_noatime);
+
 using namespace v8;
 using namespace node;
 
 static Persistent<String> kBusyMsg;
 
+static double nowSeconds() {
+  struct timeval aTv;
+  gettimeofday(&aTv, NULL);
+  return aTv.tv_sec + aTv.tv_usec / 1e6;
+}
+
+// Enquire::set_time_limit(), which ends a match early, is new in Xapian 1.4
+#define HAVE_TIME_LIMIT (XAPIAN_MAJOR_VERSION > 1 || (XAPIAN_MAJOR_VERSION == 1 && XAPIAN_MINOR_VERSION >= 4))
+
+// rejects every remaining candidate once the op is cancelled, as a MatchDecider
+// can't end the postlist walk, and the source documents of Enquire::similar()
+struct MatchCancel : public Xapian::MatchDecider {
+  MatchCancel(const volatile bool* stop, const Xapian::RSet* skip)
+    : cancelled(stop), exclude(skip) {}
+  bool operator()(const Xapian::Document& doc) const {
+    return !*cancelled && !(exclude && exclude->contains(doc.get_docid()));
+  }
+  const volatile bool* cancelled;
+  const Xapian::RSet* exclude; // else NULL
+};
+
+// expands only on unprefixed terms, so a document's ids, boolean filters and
+// field copies don't stand in for its words
+struct PlainTermDecider : public Xapian::ExpandDecider {
+  bool operator()(const std::string& term) const {
+    return !term.empty() && !(term[0] >= 'A' && term[0] <= 'Z');
+  }
+};
+
+// native bytes held by wrappers and in-flight ops, reported to V8 so that small
+// wrappers over large native state are collected promptly; see memory_stats()
+enum MemType { eMemDocument, eMemGetMset, eMemAssemble, eMemTypes };
+static const char* const kMemTypeNames[eMemTypes] = { "Document", "get_mset", "assemble_document" };
+struct MemUsage {
+  double count, bytes, peak;
+};
+static MemUsage sMemUsage[eMemTypes];
+static size_t sOpMemoryLimit = 0; // bytes one op may hold, 0 for no limit; read by pool threads
+static const size_t kDocumentBytes = 512; // a lazily loaded Xapian::Document
+
+// main thread only
+static void trackMemory(MemType type, long bytes, int count) {
+  sMemUsage[type].count += count;
+  sMemUsage[type].bytes += bytes;
+  if (sMemUsage[type].bytes > sMemUsage[type].peak)
+    sMemUsage[type].peak = sMemUsage[type].bytes;
+  V8::AdjustAmountOfExternalAllocatedMemory(bytes);
+}
+
+// pool threads call this as an op's result grows
+static void checkOpMemory(size_t bytes, const char* op) {
+  if (sOpMemoryLimit && bytes > sOpMemoryLimit)
+    throw Xapian::RangeError(std::string(op) + " exceeds memory limit");
+}
+
+// keeps scratch objects for reuse by later ops, so the steady state rarely
+// allocates; main thread only, as ops are created and deleted there
+template <class T>
+struct RecyclePool {
+  RecyclePool(size_t max) : maxfree(max) {}
+  ~RecyclePool() {
+    for (size_t a = 0; a < free.size(); ++a)
+      delete free[a];
+  }
+  T* take() {
+    if (free.empty())
+      return new T;
+    T* aT = free.back();
+    free.pop_back();
+    return aT;
+  }
+  void give(T* t) {
+    if (free.size() < maxfree)
+      free.push_back(t);
+    else
+      delete t;
+  }
+  std::vector<T*> free;
+  size_t maxfree;
+};
+
+// recycles the storage of an op struct allocated on every request; the
+// deleting destructor of a most-derived T finds these through AsyncOpBase
+template <class T>
+struct Recycled {
+  static void* operator new(size_t size) {
+    if (size != sizeof(T) || sFree.empty())
+      return ::operator new(size);
+    void* aP = sFree.back();
+    sFree.pop_back();
+    return aP;
+  }
+  static void operator delete(void* p, size_t size) {
+    if (size == sizeof(T) && sFree.size() < 64)
+      sFree.push_back(p);
+    else
+      ::operator delete(p);
+  }
+  static std::vector<void*> sFree;
+};
+template <class T>
+std::vector<void*> Recycled<T>::sFree;
+
 struct AsyncOpBase {
   AsyncOpBase(Handle<Function> cb)
-    : callback(), error(NULL) {
+    : callback(), error(NULL), memtype(eMemTypes), membytes(0), cancelled(false) {
     callback = Persistent<Function>::New(cb);
     ev_ref(EV_DEFAULT_UC);
   }
   virtual ~AsyncOpBase() {
+    for (size_t a = 0; a < handles.size(); ++a)
+      *handles[a] = NULL;
+    for (size_t a = 0; a < waiters.size(); ++a) {
+      waiters[a].callback.Dispose();
+      waiters[a].context.Dispose();
+    }
+    if (membytes) trackMemory(memtype, -(long)membytes, -1);
     if (error) delete error;
     ev_unref(EV_DEFAULT_UC);
     callback.Dispose();
   }
+  // main thread only; released when the op is deleted
+  void holdMemory(MemType type, size_t bytes) {
+    trackMemory(type, bytes, membytes ? 0 : 1);
+    memtype = type;
+    membytes += bytes;
+  }
+  // further callers given this op's result, each called with its own context
+  void addWaiter(Handle<Function> cb, Handle<Object> context) {
+    Waiter aW;
+    aW.callback = Persistent<Function>::New(cb);
+    aW.context = Persistent<Object>::New(context);
+    waiters.push_back(aW);
+  }
+  struct Waiter {
+    Persistent<Function> callback;
+    Persistent<Object> context;
+  };
+
+  // caller 0 is callback, caller n is waiters[n-1]; returns true when none remain
+  bool dropCaller(size_t n) {
+    dropped.resize(waiters.size() + 1, false);
+    dropped[n] = true;
+    for (size_t a = 0; a < dropped.size(); ++a)
+      if (!dropped[a])
+        return false;
+    return true;
+  }
+  bool isDropped(size_t n) { return n < dropped.size() && dropped[n]; }
+  virtual void onCancel() {} // main thread, when the last caller drops
+
   Persistent<Function> callback;
   Xapian::Error* error;
+  MemType memtype;
+  size_t membytes;
+  std::vector<Waiter> waiters;
+  std::vector<bool> dropped;
+  std::vector<AsyncOpBase**> handles; // OpHandle members to clear on deletion
+  volatile bool cancelled; // polled by pool threads; the executor then skips *_done
 };
 
 template <class T>
 struct AsyncOp : public AsyncOpBase {
   AsyncOp(Handle<Object> ob, Handle<Function> cb)
-    : AsyncOpBase(cb), object(ObjectWrap::Unwrap<T>(ob)) {
+    : AsyncOpBase(cb), object(ObjectWrap::Unwrap<T>(ob)), released(false) {
     if (object->mBusy)
       throw Exception::Error(kBusyMsg);
     object->mBusy = true;
     object->Ref();
   }
-  virtual ~AsyncOp() { object->Unref(); }
-  void poolDone() { object->mBusy = false; }
+  virtual ~AsyncOp() {
+    poolDone(); // if cancelled before it ran
+    object->Unref();
+  }
+  void poolDone() {
+    if (released)
+      return;
+    released = true;
+    object->mBusy = false;
+  }
   T* object;
+  bool released;
+};
+
+// spreads delivery of large results over event loop iterations, so other
+// clients' callbacks run between slices; *_done calls run() in place of
+// delivering the whole result, and the op is deleted after the last slice.
+// All ops share one queue and timer: each tick gives queued ops one slice in
+// turn until the smallest budget among them is spent, so many large results
+// together take no more of an iteration than one does
+static const double kTickBudget = 0.005; // seconds
+
+struct Slicer {
+  Slicer() : budget(kTickBudget) {}
+  virtual ~Slicer() {
+    std::deque<Slicer*>::iterator aIt = std::find(sQueue.begin(), sQueue.end(), this);
+    if (aIt != sQueue.end())
+      sQueue.erase(aIt);
+  }
+  // delivers one slice; returns true when the result is done
+  virtual bool slice() = 0;
+  void run() {
+    if (!ev_is_active(&sTimer)) {
+      ev_timer_init(&sTimer, Tick, 0., 0.);
+      ev_timer_start(EV_DEFAULT_UC, &sTimer); // fires after the loop next polls for i/o
+    }
+    sQueue.push_back(this);
+  }
+  static void Tick(EV_P_ ev_timer* w, int revents) {
+    HandleScope scope;
+    if (sQueue.empty())
+      return;
+    double aBudget = sQueue.front()->budget;
+    for (size_t a = 1; a < sQueue.size(); ++a)
+      aBudget = std::min(aBudget, sQueue[a]->budget);
+    double aDeadline = nowSeconds() + aBudget;
+    do {
+      Slicer* aNext = sQueue.front();
+      sQueue.pop_front();
+      if (aNext->slice())
+        delete aNext;
+      else
+        sQueue.push_back(aNext);
+    } while (!sQueue.empty() && nowSeconds() <= aDeadline);
+    if (!sQueue.empty())
+      ev_timer_start(EV_DEFAULT_UC, &sTimer);
+  }
+  double budget; // seconds per tick
+  static std::deque<Slicer*> sQueue; // awaiting a slice, in turn
+  static ev_timer sTimer;
+};
+std::deque<Slicer*> Slicer::sQueue;
+ev_timer Slicer::sTimer;
+
+// carries status reports from a pool thread to a function on the main thread;
+// the owning *_done calls flush() before its final callback
+struct ProgressQueue {
+  struct Record {
+    std::vector<std::pair<const char*, std::string> > strings;
+    std::vector<std::pair<const char*, double> > numbers;
+  };
+  ProgressQueue(Handle<Function> fn)
+    : callback(Persistent<Function>::New(fn)) {
+    pthread_mutex_init(&lock, NULL);
+    watcher.data = this;
+    ev_async_init(&watcher, Deliver);
+    ev_async_start(EV_DEFAULT_UC, &watcher);
+    ev_unref(EV_DEFAULT_UC); // the op's AsyncOpBase keeps the loop alive
+  }
+  ~ProgressQueue() {
+    ev_ref(EV_DEFAULT_UC);
+    ev_async_stop(EV_DEFAULT_UC, &watcher);
+    pthread_mutex_destroy(&lock);
+    callback.Dispose();
+  }
+  void push(const Record& rec) {
+    pthread_mutex_lock(&lock);
+    pending.push_back(rec);
+    pthread_mutex_unlock(&lock);
+    ev_async_send(EV_DEFAULT_UC, &watcher);
+  }
+  void flush();
+  static void Deliver(EV_P_ ev_async* w, int revents) { ((ProgressQueue*) w->data)->flush(); }
+
+  Persistent<Function> callback;
+  pthread_mutex_t lock;
+  std::vector<Record> pending;
+  ev_async watcher;
+};
+
+// runs the *_pool half of each op on threads of our own in place of libeio's,
+// so thread count and placement can be tuned; each worker takes from its own
+// deque first and steals from the others' when idle. *_done runs on the main
+// thread in completion order.
+struct Executor {
+  struct Job {
+    eio_req req; // only req.data is used, as with eio_custom()
+    eio_cb pool, done;
+    AsyncOpBase* op; // NULL if data isn't one; a cancelled op is deleted in place of done
+  };
+  struct Worker {
+    Executor* owner;
+    size_t index;
+    int cpu; // -1 for none
+    pthread_t thread;
+    pthread_mutex_t lock;
+    std::deque<Job*> jobs;
+    double executed, stolen;
+  };
+  Executor() : threads(4), started(false), stopping(false), next(0), queued(0), peakqueued(0), completed(0) {
+    pthread_mutex_init(&idlelock, NULL);
+    pthread_cond_init(&idle, NULL);
+    pthread_mutex_init(&donelock, NULL);
+  }
+
+  // req.data keeps data's own type, which *_pool and *_done cast it back to; the
+  // op, if data is one, is converted separately, so base class order doesn't matter
+  static AsyncOpBase* asOp(AsyncOpBase* op) { return op; }
+  static AsyncOpBase* asOp(const void*) { return NULL; }
+  template <class T>
+  void submit(eio_cb pool, eio_cb done, T* data) {
+    submit(pool, done, (void*) data, asOp(data));
+  }
+  void submit(eio_cb pool, eio_cb done, void* data, AsyncOpBase* op) {
+    if (!started)
+      start();
+    Job* aJob = new Job;
+    memset(&aJob->req, 0, sizeof(aJob->req));
+    aJob->req.data = data;
+    aJob->pool = pool;
+    aJob->done = done;
+    aJob->op = op;
+    Worker* aW = workers[next++ % workers.size()];
+    pthread_mutex_lock(&aW->lock);
+    aW->jobs.push_back(aJob);
+    pthread_mutex_unlock(&aW->lock);
+    pthread_mutex_lock(&idlelock);
+    if (++queued > peakqueued)
+      peakqueued = queued;
+    pthread_cond_signal(&idle);
+    pthread_mutex_unlock(&idlelock);
+  }
+
+  void start() {
+    started = true;
+    watcher.data = this;
+    ev_async_init(&watcher, Complete);
+    ev_async_start(EV_DEFAULT_UC, &watcher);
+    ev_unref(EV_DEFAULT_UC); // each op's AsyncOpBase keeps the loop alive
+    for (size_t a = 0; a < threads; ++a) {
+      Worker* aW = new Worker;
+      aW->owner = this;
+      aW->index = a;
+      aW->cpu = cpus.empty() ? -1 : cpus[a % cpus.size()];
+      aW->executed = aW->stolen = 0;
+      pthread_mutex_init(&aW->lock, NULL);
+      workers.push_back(aW);
+    }
+    for (size_t a = 0; a < workers.size(); ++a) // workers read the full list when stealing
+      pthread_create(&workers[a]->thread, NULL, Run, workers[a]);
+  }
+
+  // workers finish the job in hand and exit, abandoning any queued; a Node 0.4
+  // addon has no unload hook, so init() registers this with atexit()
+  void stop() {
+    if (!started)
+      return;
+    pthread_mutex_lock(&idlelock);
+    stopping = true;
+    pthread_cond_broadcast(&idle);
+    pthread_mutex_unlock(&idlelock);
+    for (size_t a = 0; a < workers.size(); ++a)
+      pthread_join(workers[a]->thread, NULL);
+    started = false;
+  }
+
+  Job* take(Worker* w) {
+    Job* aJob = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (!w->jobs.empty()) {
+      aJob = w->jobs.front();
+      w->jobs.pop_front();
+    }
+    pthread_mutex_unlock(&w->lock);
+    for (size_t a = 1; !aJob && a < workers.size(); ++a) {
+      Worker* aV = workers[(w->index + a) % workers.size()];
+      pthread_mutex_lock(&aV->lock);
+      if (!aV->jobs.empty()) {
+        aJob = aV->jobs.back();
+        aV->jobs.pop_back();
+      }
+      pthread_mutex_unlock(&aV->lock);
+      if (aJob) {
+        pthread_mutex_lock(&w->lock);
+        ++w->stolen;
+        pthread_mutex_unlock(&w->lock);
+      }
+    }
+    if (aJob) {
+      pthread_mutex_lock(&idlelock);
+      --queued;
+      pthread_mutex_unlock(&idlelock);
+    }
+    return aJob;
+  }
+
+  // takes op off the queues if it hasn't started
+  bool remove(AsyncOpBase* op) {
+    for (size_t a = 0; a < workers.size(); ++a) {
+      Worker* aW = workers[a];
+      pthread_mutex_lock(&aW->lock);
+      for (std::deque<Job*>::iterator aIt = aW->jobs.begin(); aIt != aW->jobs.end(); ++aIt) {
+        if ((*aIt)->op == op) {
+          delete *aIt;
+          aW->jobs.erase(aIt);
+          pthread_mutex_unlock(&aW->lock);
+          pthread_mutex_lock(&idlelock);
+          --queued;
+          pthread_mutex_unlock(&idlelock);
+          return true;
+        }
+      }
+      pthread_mutex_unlock(&aW->lock);
+    }
+    return false;
+  }
+
+  static void* Run(void* arg) {
+    Worker* aW = (Worker*) arg;
+    Executor* aE = aW->owner;
+#ifdef __linux__
+    if (aW->cpu >= 0) {
+      cpu_set_t aSet;
+      CPU_ZERO(&aSet);
+      CPU_SET(aW->cpu, &aSet);
+      pthread_setaffinity_np(pthread_self(), sizeof(aSet), &aSet);
+    }
+#endif
+    for (;;) {
+      pthread_mutex_lock(&aE->idlelock);
+      bool aStop = aE->stopping;
+      pthread_mutex_unlock(&aE->idlelock);
+      if (aStop)
+        break;
+      Job* aJob = aE->take(aW);
+      if (!aJob) {
+        pthread_mutex_lock(&aE->idlelock);
+        while (aE->queued == 0 && !aE->stopping)
+          pthread_cond_wait(&aE->idle, &aE->idlelock);
+        pthread_mutex_unlock(&aE->idlelock);
+        continue;
+      }
+      aJob->pool(&aJob->req);
+      pthread_mutex_lock(&aW->lock);
+      ++aW->executed;
+      pthread_mutex_unlock(&aW->lock);
+      pthread_mutex_lock(&aE->donelock);
+      aE->finished.push_back(aJob);
+      pthread_mutex_unlock(&aE->donelock);
+      ev_async_send(EV_DEFAULT_UC, &aE->watcher);
+    }
+    return NULL;
+  }
+
+  static void Complete(EV_P_ ev_async* w, int revents) {
+    Executor* aE = (Executor*) w->data;
+    std::vector<Job*> aList;
+    pthread_mutex_lock(&aE->donelock);
+    aList.swap(aE->finished);
+    pthread_mutex_unlock(&aE->donelock);
+    for (size_t a = 0; a < aList.size(); ++a) {
+      if (aList[a]->op && aList[a]->op->cancelled)
+        delete aList[a]->op;
+      else
+        aList[a]->done(&aList[a]->req);
+      delete aList[a];
+      ++aE->completed;
+    }
+  }
+
+  size_t threads; // settable until the first submit()
+  std::vector<int> cpus; // worker n runs on cpus[n % size]; empty for no affinity
+  bool started;
+  bool stopping; // guarded by idlelock
+  std::vector<Worker*> workers;
+  size_t next;
+  pthread_mutex_t idlelock;
+  pthread_cond_t idle;
+  size_t queued, peakqueued;
+  pthread_mutex_t donelock;
+  std::vector<Job*> finished;
+  ev_async watcher;
+  double completed;
+};
+
+static Executor sExecutor;
+
+static void stopExecutor() { sExecutor.stop(); }
+
+static const size_t kFdsPerHandle = 6; // tables a chert/flint reader may hold open
+
+// read-only handles kept open after their Database is collected, for reuse by
+// the next Database on that path; least recently used are closed over budget
+struct HandleCache {
+  HandleCache() : maxfds(0), open(0) { pthread_mutex_init(&lock, NULL); }
+  struct Entry {
+    std::string path;
+    Xapian::Database* db;
+  };
+  typedef std::list<Entry> Lru; // most recent first
+  typedef std::multimap<std::string, Lru::iterator> Index;
+
+  bool enabled() { return maxfds > 0; }
+  void configure(size_t fds) {
+    pthread_mutex_lock(&lock);
+    maxfds = fds;
+    trim();
+    pthread_mutex_unlock(&lock);
+  }
+  // returns an idle handle, or NULL when the caller should open one for the cache
+  Xapian::Database* take(const std::string& path) {
+    Xapian::Database* aDb = NULL;
+    pthread_mutex_lock(&lock);
+    Index::iterator aIt = index.find(path);
+    if (aIt != index.end()) {
+      aDb = aIt->second->db;
+      lru.erase(aIt->second);
+      index.erase(aIt);
+    } else {
+      ++open;
+      trim();
+    }
+    pthread_mutex_unlock(&lock);
+    return aDb;
+  }
+  void give(const std::string& path, Xapian::Database* db) {
+    pthread_mutex_lock(&lock);
+    Entry aEntry = { path, db };
+    lru.push_front(aEntry);
+    index.insert(std::make_pair(path, lru.begin()));
+    trim();
+    pthread_mutex_unlock(&lock);
+  }
+  // a handle from take() was closed by its owner or never opened
+  void drop() {
+    pthread_mutex_lock(&lock);
+    --open;
+    pthread_mutex_unlock(&lock);
+  }
+  void trim() {
+    while (open * kFdsPerHandle > maxfds && !lru.empty()) {
+      Entry& aEntry = lru.back();
+      for (Index::iterator aIt = index.find(aEntry.path); aIt != index.end() && aIt->first == aEntry.path; ++aIt) {
+        if (aIt->second->db == aEntry.db) {
+          index.erase(aIt);
+          break;
+        }
+      }
+      try {
+        aEntry.db->close();
+      } catch (const Xapian::Error& err) {
+      }
+      delete aEntry.db;
+      lru.pop_back();
+      --open;
+    }
+  }
+
+  size_t maxfds, open;
+  Lru lru;
+  Index index;
+  pthread_mutex_t lock;
+};
+
+static HandleCache sHandleCache;
+
+// data, and values in chosen slots, of recently read documents of read-only
+// Databases, keyed by Database::getRevisionKey() and docid; Document::get_data(),
+// get_values() and get_mset()'s prefetch and snippets share it from pool threads
+struct DocCache {
+  DocCache() : maxbytes(0), bytes(0), hits(0), misses(0), evictions(0) { pthread_mutex_init(&lock, NULL); }
+  typedef std::vector<std::pair<Xapian::valueno, std::string> > Values;
+  struct Entry {
+    std::string key, data;
+    Values values; // cached slots which have a value
+    size_t bytes;
+  };
+  typedef std::list<Entry> Lru; // most recent first
+  typedef std::map<std::string, Lru::iterator> Index;
+
+  // main thread only; a key for each Document that may use the cache
+  bool enabled() { return maxbytes > 0; }
+  static std::string key(const std::string& revision, Xapian::docid id) {
+    char aId[16];
+    snprintf(aId, sizeof(aId), ":%u", id);
+    return revision + aId;
+  }
+  void configure(size_t max, const std::vector<Xapian::valueno>& slotlist) {
+    pthread_mutex_lock(&lock);
+    maxbytes = max;
+    if (slotlist != slots) { // entries lack the new slots
+      slots = slotlist;
+      lru.clear();
+      index.clear();
+      bytes = 0;
+    }
+    trim();
+    pthread_mutex_unlock(&lock);
+  }
+  // copies out a cached entry; values only if every slot in want is cached
+  bool get(const std::string& k, std::string* data, const std::vector<Xapian::valueno>* want, Values* values) {
+    pthread_mutex_lock(&lock);
+    Index::iterator aIt = index.find(k);
+    bool aHit = aIt != index.end();
+    for (size_t a = 0; aHit && want && a < want->size(); ++a)
+      aHit = std::find(slots.begin(), slots.end(), (*want)[a]) != slots.end();
+    if (aHit) {
+      lru.splice(lru.begin(), lru, aIt->second);
+      Entry& aEntry = *aIt->second;
+      if (data)
+        *data = aEntry.data;
+      for (size_t a = 0; want && a < want->size(); ++a)
+        for (size_t aV = 0; aV < aEntry.values.size(); ++aV)
+          if (aEntry.values[aV].first == (*want)[a])
+            values->push_back(aEntry.values[aV]);
+      ++hits;
+    } else {
+      ++misses;
+    }
+    pthread_mutex_unlock(&lock);
+    return aHit;
+  }
+  bool has(const std::string& k) {
+    pthread_mutex_lock(&lock);
+    bool aHas = index.count(k) > 0;
+    pthread_mutex_unlock(&lock);
+    return aHas;
+  }
+  // reads doc outside the lock, caches it and returns its data
+  std::string load(const std::string& k, const Xapian::Document& doc) {
+    Entry aEntry;
+    aEntry.key = k;
+    aEntry.data = doc.get_data();
+    pthread_mutex_lock(&lock);
+    std::vector<Xapian::valueno> aSlots(slots);
+    pthread_mutex_unlock(&lock);
+    aEntry.bytes = sizeof(Entry) + k.size() + aEntry.data.size() + 32;
+    for (size_t a = 0; a < aSlots.size(); ++a) {
+      std::string aVal(doc.get_value(aSlots[a]));
+      if (aVal.empty())
+        continue;
+      aEntry.bytes += sizeof(Values::value_type) + aVal.size();
+      aEntry.values.push_back(std::make_pair(aSlots[a], aVal));
+    }
+    pthread_mutex_lock(&lock);
+    if (aSlots == slots && aEntry.bytes <= maxbytes && !index.count(k)) {
+      lru.push_front(aEntry);
+      index[k] = lru.begin();
+      bytes += aEntry.bytes;
+      trim();
+    }
+    pthread_mutex_unlock(&lock);
+    return aEntry.data;
+  }
+  // data from the cache when key isn't empty, else from doc
+  std::string data(const std::string& k, const Xapian::Document& doc) {
+    std::string aData;
+    if (k.empty())
+      return doc.get_data();
+    if (!get(k, &aData, NULL, NULL))
+      aData = load(k, doc);
+    return aData;
+  }
+  void trim() {
+    while (bytes > maxbytes && !lru.empty()) {
+      bytes -= lru.back().bytes;
+      index.erase(lru.back().key);
+      lru.pop_back();
+      ++evictions;
+    }
+  }
+
+  size_t maxbytes, bytes;
+  double hits, misses, evictions;
+  std::vector<Xapian::valueno> slots;
+  Lru lru;
+  Index index;
+  pthread_mutex_t lock;
+};
+
+static DocCache sDocCache;
+
+// returned by cancellable async methods; cancel() drops this caller's callback,
+// and stops the op when no other caller shares it
+class OpHandle : public ObjectWrap {
+public:
+  static void Init(Handle<Object> target);
+
+  static Persistent<FunctionTemplate> constructor_template;
+
+  static Local<Object> NewInstance(AsyncOpBase* op, size_t caller=0);
+
+protected:
+  OpHandle() : ObjectWrap(), mOp(NULL), mCaller(0) {}
+
+  ~OpHandle() {
+    if (mOp)
+      mOp->handles.erase(std::find(mOp->handles.begin(), mOp->handles.end(), &mOp));
+  }
+
+  AsyncOpBase* mOp; // NULL once the op is deleted
+  size_t mCaller;
+
+  static Handle<Value> New(const Arguments& args);
+
+  static Handle<Value> Cancel(const Arguments& args);
 };
 
 class Database : public EventEmitter {
@@ -47,15 +737,30 @@ public:
 
   static Persistent<FunctionTemplate> constructor_template;
 
+  static Local<Object> NewInstance(Xapian::Database* db, const std::vector<std::string>& paths);
+
   Xapian::Database& getDb() { return *mDb; }
+  // identifies this database's current contents for Enquire coalescing
+  std::string getRevisionKey() {
+    char aKey[32];
+    snprintf(aKey, sizeof(aKey), "%u.%u", mSerial, mGeneration);
+    return aKey;
+  }
 
 protected:
-  Database() : EventEmitter(), mDb(NULL), mBusy(false) {}
+  Database() : EventEmitter(), mDb(NULL), mBusy(false), mCached(false), mMerged(false), mCounted(0), mSerial(++sSerials), mGeneration(0) {}
 
+  // Enquires and get_mset() Documents keep this alive, so no pool thread can
+  // still reach mDb when it goes back to sHandleCache
   virtual ~Database() {
-    if (mDb) {
-      mDb->close();
+    if (mCached) {
+      sHandleCache.give(mPaths[0], mDb);
+    } else if (mDb) {
+      if (!mMerged)
+        mDb->close();
       delete mDb;
+      for (; mCounted > 0; --mCounted)
+        sHandleCache.drop();
     }
   }
 
@@ -64,24 +769,122 @@ protected:
     Xapian::WritableDatabase* mWdb;
   };
   bool mBusy;
+  bool mCached; // mDb belongs to sHandleCache
+  bool mMerged; // mDb was added to another Database, which still uses its shards
+  unsigned mCounted; // handles in sHandleCache's open count, until mDb is closed
+  std::vector<std::string> mPaths; // of each shard
+  unsigned mSerial, mGeneration; // generation counts opens and add_database()s
+  static unsigned sSerials;
 
   friend struct AsyncOp<Database>;
 
   static Handle<Value> New(const Arguments& args);
 
+  static Handle<Value> SetHandleCache(const Arguments& args);
+  static Handle<Value> SetDocumentCache(const Arguments& args);
+  static Handle<Value> DocumentCacheStats(const Arguments& args);
+
+  static Handle<Value> OpenDatabases(const Arguments& args);
+  static int OpenShard_pool(eio_req *req);
+  static int OpenShard_done(eio_req *req);
+  struct OpenDatabases_data : AsyncOpBase {
+    OpenDatabases_data(Handle<Function> cb, size_t n)
+      : AsyncOpBase(cb), shards(n, (Xapian::Database*)NULL), errors(n, (Xapian::Error*)NULL), pending(n) {}
+    ~OpenDatabases_data() {
+      for (size_t a = 0; a < shards.size(); ++a) {
+        if (shards[a]) delete shards[a];
+        if (errors[a]) delete errors[a];
+      }
+    }
+    std::vector<std::string> paths;
+    std::vector<Xapian::Database*> shards;
+    std::vector<Xapian::Error*> errors;
+    size_t pending;
+  };
+  struct OpenShard_data {
+    OpenDatabases_data* group;
+    size_t index;
+  };
+
   static Handle<Value> AddDatabase(const Arguments& args);
 
+  static Handle<Value> Warm(const Arguments& args);
+  static int Warm_pool(eio_req *req);
+  static int Warm_done(eio_req *req);
+  struct Warm_data : AsyncOp<Database> {
+    Warm_data(Handle<Object> ob, Handle<Function> cb, const std::vector<std::string>& pa)
+      : AsyncOp<Database>(ob, cb), paths(pa), read(true), topterms(0), bytes(0), files(0), postings(0), seconds(0) {}
+    std::vector<std::string> paths, tables;
+    bool read;
+    uint32_t topterms;
+    double bytes;
+    uint32_t files, postings;
+    double seconds;
+  };
+
   static Handle<Value> Reopen(const Arguments& args);
   static int Open_pool(eio_req *req);
   static int Open_done(eio_req *req);
   struct Open_data : AsyncOp<Database> {
-    Open_data(Handle<Object> ob, Handle<String> file, int wop=0)
-      : AsyncOp<Database>(ob, Handle<Function>()), filename(file), writeopts(wop) {}
+    Open_data(Handle<Object> ob, Handle<String> file, int wop=0, bool mem=false)
+      : AsyncOp<Database>(ob, Handle<Function>()), filename(file), writeopts(wop), inmemory(mem) {}
     String::Utf8Value filename;
     int writeopts;
+    bool inmemory; // filename, if any, is loaded into an InMemory database
+  };
+  static Handle<Value> Open_options(const Arguments& args, int index, bool* inmemory);
+
+  static Handle<Value> Snapshot(const Arguments& args);
+  static int Snapshot_pool(eio_req *req);
+  static int Snapshot_done(eio_req *req);
+  struct Snapshot_data : AsyncOp<Database> {
+    Snapshot_data(Handle<Object> ob, Handle<Function> cb, Handle<String> file)
+      : AsyncOp<Database>(ob, cb), filename(file) {}
+    String::Utf8Value filename;
   };
 };
 
+class TermGenerator;
+class Mime2Text;
+class DatabaseReplica;
+
+// the one Xapian::Document behind any Document wrappers that share it, as coalesced
+// get_mset callers do; Xapian loads and refcounts a document without locking, so
+// pool threads hold mutex while using doc, and it is never copied; refs are main thread only
+struct SharedDoc {
+  SharedDoc(const Xapian::Document& d) : doc(d), refs(0) { pthread_mutex_init(&mutex, NULL); }
+  ~SharedDoc() {
+    pthread_mutex_destroy(&mutex);
+    if (!owner.IsEmpty())
+      owner.Dispose();
+  }
+  void ref() { ++refs; }
+  void unref() { if (--refs == 0) delete this; }
+  Xapian::Document doc;
+  pthread_mutex_t mutex;
+  int refs;
+  Persistent<Object> owner; // the Database doc reads from, if any, so its handle isn't recycled under doc
+};
+// locks a SharedDoc for a pool function's scope
+struct SharedDocLock {
+  SharedDocLock(SharedDoc* d) : doc(d) { pthread_mutex_lock(&doc->mutex); }
+  ~SharedDocLock() { pthread_mutex_unlock(&doc->mutex); }
+  SharedDoc* doc;
+};
+
+// term prefix and wdf multiplier for each Mime2Text field, set by a fields object;
+// fields are indexed without prefix as well, so general queries still match them
+struct FieldMap {
+  enum { eTitle, eAuthor, eKeywords, eBody, eFields };
+  FieldMap() {
+    for (int a = 0; a < eFields; ++a)
+      weight[a] = 1;
+  }
+  std::string prefix[eFields]; // empty for no prefixed copy
+  Xapian::termcount weight[eFields];
+};
+static const char* const kFieldNames[FieldMap::eFields] = { "title", "author", "keywords", "body" };
+
 class WritableDatabase : public Database {
 public:
   static void Init(Handle<Object> target);
@@ -91,9 +894,12 @@ public:
   Xapian::WritableDatabase& getWdb() { return *mWdb; }
 
 protected:
-  WritableDatabase() : Database() { }
+  WritableDatabase() : Database(), mCommit(NULL) { }
 
-  ~WritableDatabase() { }
+  ~WritableDatabase() {
+    for (size_t a = 0; a < mReplicas.size(); ++a)
+      mReplicas[a].Dispose();
+  }
 
   friend struct AsyncOp<WritableDatabase>;
 
@@ -103,13 +909,44 @@ protected:
   static int AddDocument_pool(eio_req *req);
   static int AddDocument_done(eio_req *req);
   struct AddDocument_data : AsyncOp<WritableDatabase> {
-    AddDocument_data(Handle<Object> ob, Handle<Function> cb, const Xapian::Document& doc, Handle<String> id)
-      : AsyncOp<WritableDatabase>(ob, cb), document(doc), idterm(id) {}
-    const Xapian::Document& document;
+    AddDocument_data(Handle<Object> ob, Handle<Function> cb, SharedDoc* doc, Handle<String> id)
+      : AsyncOp<WritableDatabase>(ob, cb), document(doc), idterm(id) { document->ref(); }
+    ~AddDocument_data() { document->unref(); }
+    SharedDoc* document;
     Xapian::docid docid;
     String::Utf8Value idterm;
   };
 
+  static Handle<Value> DeleteDocuments(const Arguments& args);
+  static int DeleteDocuments_pool(eio_req *req);
+  static int DeleteDocuments_done(eio_req *req);
+  struct DeleteDocuments_data : AsyncOp<WritableDatabase> {
+    DeleteDocuments_data(Handle<Object> ob, Handle<Function> cb, bool tx)
+      : AsyncOp<WritableDatabase>(ob, cb), usequery(false), transaction(tx), count(0) {}
+    std::vector<std::string> idterms;
+    std::vector<Xapian::docid> docids;
+    Xapian::Query query;
+    bool usequery;
+    bool transaction;
+    Xapian::doccount count;
+  };
+
+  static Handle<Value> SetMaxChangesets(const Arguments& args);
+  static Handle<Value> AddReplica(const Arguments& args);
+  std::vector<Persistent<Object> > mReplicas; // DatabaseReplicas given changesets after each commit
+
+  static Handle<Value> WriteChangesets(const Arguments& args);
+  static int WriteChangesets_pool(eio_req *req);
+  static int WriteChangesets_done(eio_req *req);
+  struct WriteChangesets_data : AsyncOp<WritableDatabase> {
+    WriteChangesets_data(Handle<Object> ob, Handle<Function> cb, int f, Handle<String> rev, const std::string& pa)
+      : AsyncOp<WritableDatabase>(ob, cb), fd(f), revision(rev), path(pa) {}
+    int fd;
+    String::Utf8Value revision;
+    std::string path;
+    Xapian::ReplicationInfo info;
+  };
+
   static Handle<Value> Commit(const Arguments& args);
   static Handle<Value> BeginTransaction(const Arguments& args);
   static Handle<Value> CommitTransaction(const Arguments& args);
@@ -118,10 +955,132 @@ protected:
   static int Commit_done(eio_req *req);
   struct Commit_data : AsyncOp<WritableDatabase> {
     Commit_data(Handle<Object> ob, Handle<Function> cb, int op, bool fl=false)
-      : AsyncOp<WritableDatabase>(ob, cb), type(op), flush(fl) {}
+      : AsyncOp<WritableDatabase>(ob, cb), type(op), flush(fl), finished(false) {}
     enum { eCommit, eBeginTx, eCommitTx };
     int type;
     bool flush;
+    volatile bool finished; // set by the pool thread before releasing the database to writes
+    std::string path; // of the master, for publishing
+    std::vector<DatabaseReplica*> replicas; // held busy until each is updated
+    std::vector<Xapian::ReplicationInfo> replicainfo;
+    std::vector<std::string> replicaerror; // empty for success
+  };
+  Commit_data* mCommit; // commit() queued or running, which further commit() calls join
+  void holdReplicas(Commit_data* data);
+  static void publishChangesets(Commit_data* data);
+
+  static Handle<Value> IndexDirectory(const Arguments& args);
+  static int IndexList_pool(eio_req *req);
+  static int IndexList_done(eio_req *req);
+  static int IndexWalk_pool(eio_req *req);
+  static int IndexWalk_done(eio_req *req);
+  static int IndexConvert_pool(eio_req *req);
+  static int IndexConvert_done(eio_req *req);
+  static int IndexBatch_pool(eio_req *req);
+  static int IndexBatch_done(eio_req *req);
+  // holds the database busy from the walk through the last batch
+  struct IndexDirectory_data : AsyncOp<WritableDatabase> {
+    struct File {
+      std::string path, idterm;
+      double mtime, size;
+      Xapian::docid docid; // of the existing document, 0 for none
+      std::string oldmd5;
+      Xapian::Mime2Text::Fields fields;
+      bool failed;
+      bool samemd5; // matched oldmd5, so conversion was skipped
+    };
+    IndexDirectory_data(Handle<Object> ob, Handle<Function> cb, Handle<Object> tg, Handle<Object> m2t, Handle<Value> ro)
+      : AsyncOp<WritableDatabase>(ob, cb), termgen(NULL), mime2text(NULL), root(*String::Utf8Value(ro)), idprefix("Q"),
+        mtimeslot(0), sizeslot(1), md5slot(Xapian::BAD_VALUENO), parallel(4), batchsize(100), commit(true), prune(false),
+        listing(0), nextconvert(0), converting(0), indexing(false), seen(0), unchanged(0), indexed(0), updated(0), failed(0),
+        deleted(0), started(nowSeconds()) {
+      termgenObj = Persistent<Object>::New(tg);
+      mime2textObj = Persistent<Object>::New(m2t);
+      while (root.size() > 1 && root[root.size()-1] == '/')
+        root.erase(root.size()-1);
+    }
+    ~IndexDirectory_data(); // after TermGenerator
+    TermGenerator* termgen;
+    Mime2Text* mime2text;
+    Persistent<Object> termgenObj, mime2textObj; // keep the above alive
+    std::string root, idprefix;
+    Xapian::valueno mtimeslot, sizeslot, md5slot; // BAD_VALUENO for none
+    FieldMap fieldmap;
+    size_t parallel, batchsize;
+    bool commit, prune;
+    Persistent<Function> progress;
+    std::vector<std::string> dirs; // awaiting a listing job
+    size_t listing;
+    std::vector<std::string> unlisted; // paths that failed to list or stat, whose documents prune keeps
+    std::vector<std::string> errors; // "path: reason" for each of unlisted
+    std::vector<File> files; // all found during the walk; then changed or new ones
+    std::vector<size_t> ready; // converted, awaiting a batch
+    std::vector<Xapian::Mime2Text*> converters; // idle copies of mime2text's, one per running conversion
+    size_t nextconvert, converting;
+    bool indexing;
+    double seen, unchanged, indexed, updated, failed, deleted, started;
+  };
+  struct IndexStep_data {
+    IndexDirectory_data* group;
+    std::vector<size_t> items; // in group->files
+    Xapian::Mime2Text* converter;
+  };
+  struct IndexList_data {
+    IndexDirectory_data* group;
+    std::string dir;
+    int error; // errno from opendir(), else 0
+    std::vector<std::string> dirs;
+    std::vector<IndexDirectory_data::File> files;
+    std::vector<std::pair<std::string, int> > unstatted; // entries and errno from lstat()
+  };
+  static void IndexWalk_next(IndexDirectory_data* data);
+  static void IndexDirectory_next(IndexDirectory_data* data);
+  static Local<Object> IndexDirectory_info(IndexDirectory_data* data);
+  static void IndexDirectory_progress(IndexDirectory_data* data, const char* phase);
+};
+
+class DatabaseReplica : public EventEmitter {
+public:
+  static void Init(Handle<Object> target);
+
+  static Persistent<FunctionTemplate> constructor_template;
+
+protected:
+  DatabaseReplica() : EventEmitter(), mReplica(NULL), mBusy(false) {}
+
+  ~DatabaseReplica() {
+    if (mReplica) {
+      mReplica->close();
+      delete mReplica;
+    }
+  }
+
+  Xapian::DatabaseReplica* mReplica;
+  bool mBusy;
+
+  friend struct AsyncOp<DatabaseReplica>;
+  friend class WritableDatabase;
+
+  static Handle<Value> New(const Arguments& args);
+  static int Open_pool(eio_req *req);
+  static int Open_done(eio_req *req);
+  struct Open_data : AsyncOp<DatabaseReplica> {
+    Open_data(Handle<Object> ob, Handle<String> file)
+      : AsyncOp<DatabaseReplica>(ob, Handle<Function>()), filename(file) {}
+    String::Utf8Value filename;
+  };
+
+  static Handle<Value> GetRevisionInfo(const Arguments& args);
+
+  static Handle<Value> ApplyChangesets(const Arguments& args);
+  static int ApplyChangesets_pool(eio_req *req);
+  static int ApplyChangesets_done(eio_req *req);
+  struct ApplyChangesets_data : AsyncOp<DatabaseReplica> {
+    ApplyChangesets_data(Handle<Object> ob, Handle<Function> cb, int f, double ct)
+      : AsyncOp<DatabaseReplica>(ob, cb), fd(f), closetime(ct) {}
+    int fd;
+    double closetime;
+    Xapian::ReplicationInfo info;
   };
 };
 
@@ -132,9 +1091,10 @@ public:
   static Persistent<FunctionTemplate> constructor_template;
 
   Xapian::TermGenerator mTg;
+  bool mBusy; // mTg is in use by an assemble_document or index_directory job
 
 protected:
-  TermGenerator() : ObjectWrap(), mTg() { }
+  TermGenerator() : ObjectWrap(), mTg(), mBusy(false) { }
 
   ~TermGenerator() { }
 
@@ -147,6 +1107,16 @@ protected:
   static Handle<Value> SetStemmer(const Arguments& args);
 };
 
+WritableDatabase::IndexDirectory_data::~IndexDirectory_data() {
+  for (size_t a = 0; a < converters.size(); ++a)
+    delete converters[a];
+  if (termgen)
+    termgen->mBusy = false;
+  termgenObj.Dispose();
+  mime2textObj.Dispose();
+  progress.Dispose();
+}
+
 class Stem : public ObjectWrap {
 public:
   static void Init(Handle<Object> target);
@@ -154,15 +1124,71 @@ public:
   static Persistent<FunctionTemplate> constructor_template;
 
   Xapian::Stem mStem;
+  std::string mLang; // Xapian::Stem isn't safe to share across pool threads
 
 protected:
-  Stem(const char* iLang) : ObjectWrap(), mStem(iLang) { }
+  Stem(const char* iLang) : ObjectWrap(), mStem(iLang), mLang(iLang) { }
 
   ~Stem() { }
 
   static Handle<Value> New(const Arguments& args);
 };
 
+class Weight : public ObjectWrap {
+public:
+  static void Init(Handle<Object> target);
+
+  static Persistent<FunctionTemplate> constructor_template;
+
+  Xapian::Weight* mWeight; // Enquire::set_weighting_scheme() clones it
+  std::string mKey; // scheme and parameters, for Enquire::GetMset_key()
+
+protected:
+  Weight(Xapian::Weight* iWeight, const std::string& iKey) : ObjectWrap(), mWeight(iWeight), mKey(iKey) { }
+
+  ~Weight() {
+    delete mWeight;
+  }
+
+  static Handle<Value> New(const Arguments& args);
+};
+
+class BoolWeight : public Weight {
+public:
+  static void Init(Handle<Object> target);
+
+  static Persistent<FunctionTemplate> constructor_template;
+
+protected:
+  BoolWeight() : Weight(new Xapian::BoolWeight, "bool") { }
+
+  static Handle<Value> New(const Arguments& args);
+};
+
+class BM25Weight : public Weight {
+public:
+  static void Init(Handle<Object> target);
+
+  static Persistent<FunctionTemplate> constructor_template;
+
+protected:
+  BM25Weight(const double* iP, const char* iKey) : Weight(new Xapian::BM25Weight(iP[0], iP[1], iP[2], iP[3], iP[4]), iKey) { }
+
+  static Handle<Value> New(const Arguments& args);
+};
+
+class TradWeight : public Weight {
+public:
+  static void Init(Handle<Object> target);
+
+  static Persistent<FunctionTemplate> constructor_template;
+
+protected:
+  TradWeight(double iK, const char* iKey) : Weight(new Xapian::TradWeight(iK), iKey) { }
+
+  static Handle<Value> New(const Arguments& args);
+};
+
 class Enquire : public ObjectWrap {
 public:
   static void Init(Handle<Object> target);
@@ -170,39 +1196,118 @@ public:
   static Persistent<FunctionTemplate> constructor_template;
 
 protected:
-  Enquire(const Xapian::Database& iDb) : ObjectWrap(), mEnq(iDb), mBusy(false) {}
+  Enquire(Database* iDb, Handle<Object> iDbObj, bool iCoalesce)
+    : ObjectWrap(), mEnq(iDb->getDb()), mBusy(false), mDatabase(iDb), mDbObj(Persistent<Object>::New(iDbObj)),
+      mCoalesce(iCoalesce), mCollapse("-"), mWeighting("-") {}
 
   ~Enquire() {
+    mDbObj.Dispose();
   }
 
   Xapian::Enquire mEnq;
   bool mBusy;
+  Database* mDatabase; // kept alive by mDbObj
+  Persistent<Object> mDbObj;
+  bool mCoalesce; // false for a WritableDatabase, whose contents change between commits
+  std::string mCollapse, mWeighting; // settings not visible in the query, for GetMset_key()
 
   friend struct AsyncOp<Enquire>;
 
   static Handle<Value> New(const Arguments& args);
 
   static Handle<Value> SetQuery(const Arguments& args);
+  static Handle<Value> SetCollapseKey(const Arguments& args);
+  static Handle<Value> SetWeightingScheme(const Arguments& args);
 
   static Handle<Value> GetMset(const Arguments& args);
+  static Handle<Value> Similar(const Arguments& args);
   static int GetMset_pool(eio_req *req);
   static int GetMset_done(eio_req *req);
-  struct GetMset_data : AsyncOp<Enquire> {
-    GetMset_data(Handle<Object> ob, Handle<Function> cb, uint32_t fi, uint32_t mx)
-      : AsyncOp<Enquire>(ob, cb), first(fi), maxitems(mx), set(NULL) {}
-    ~GetMset_data() { if (set) delete [] set; }
+  struct GetMset_data : AsyncOp<Enquire>, Recycled<GetMset_data>, Slicer {
+    struct Options {
+      Options() : checkatleast(0), percentcutoff(0), weightcutoff(0), timelimit(0),
+                  snippet(false), snippetlength(200), histart("<b>"), hiend("</b>"), omit("..."), prefetch(false), cancellable(false),
+                  expandterms(40), eliteterms(20), batchsize(0), tickbudget(kTickBudget) {}
+      Xapian::doccount checkatleast;
+      Xapian::percent percentcutoff;
+      Xapian::weight weightcutoff;
+      double timelimit; // seconds
+      bool snippet;
+      size_t snippetlength;
+      std::string histart, hiend, omit, stemlang;
+      std::map<Xapian::valueno, size_t> facets; // slot -> maxvalues, 0 for all
+      bool prefetch;
+      bool cancellable; // cancel() may stop a running match, not only a queued one
+      std::vector<Xapian::docid> similar; // relevance set for Enquire::similar(), else empty
+      Xapian::termcount expandterms, eliteterms;
+      size_t batchsize; // hits per callback, 0 for all in one
+      double tickbudget; // seconds
+    };
+    GetMset_data(Handle<Object> ob, Handle<Function> cb, uint32_t fi, uint32_t mx, const Options& op)
+      : AsyncOp<Enquire>(ob, cb), first(fi), maxitems(mx), options(op), resultbytes(0), scratch(sScratch.take()), size(0),
+        nextcaller(0), nextitem(0) {
+      budget = op.tickbudget;
+    }
+    ~GetMset_data() {
+      leaveInFlight();
+      for (size_t a = 0; a < shared.size(); ++a)
+        if (shared[a])
+          shared[a]->unref();
+      // items keep their string capacity for the next op; documents are handles
+      // on the database, so they are released now
+      scratch->documents.clear();
+      if (scratch->items.size() > 1000)
+        delete scratch;
+      else
+        sScratch.give(scratch);
+      for (size_t a = 0; a < spies.size(); ++a)
+        delete spies[a];
+    }
     Xapian::doccount first, maxitems;
+    Options options;
+    Xapian::doccount estimated, lowerbound, upperbound;
+    size_t resultbytes;
+    std::vector<Xapian::ValueCountMatchSpy*> spies;
+    struct Facet {
+      Xapian::valueno slot;
+      size_t total;
+      std::vector<std::pair<std::string, Xapian::doccount> > counts;
+    };
+    std::vector<Facet> facetlist;
+    std::vector<std::string> expanded; // similar() query terms
     struct Item {
       Xapian::docid id;
-      Xapian::Document* document;
       Xapian::doccount rank, collapse_count;
       Xapian::weight weight;
-      std::string collapse_key, description;
+      std::string collapse_key, description, snippet;
       Xapian::percent percent;
     };
-    Item* set;
+    struct Scratch {
+      std::vector<Item> items; // only grows; the first size are in use
+      std::vector<Xapian::Document> documents;
+    };
+    static RecyclePool<Scratch> sScratch;
+    Scratch* scratch;
+    std::vector<SharedDoc*> shared; // moved out of scratch->documents at first delivery
     int size;
+    std::string key; // in sInFlight, empty if not coalescing
+    std::string revision; // for sDocCache keys, empty if not caching
+    void leaveInFlight() { // later calls start a new match
+      if (!key.empty())
+        sInFlight.erase(key);
+      key.clear();
+    }
+    void onCancel() { leaveInFlight(); }
+    size_t nextcaller; // batch delivery position
+    int nextitem;
+    bool slice();
   };
+  static std::map<std::string, GetMset_data*> sInFlight;
+  static Handle<Value> GetMset_start(Handle<Object> obj, uint32_t first, uint32_t max, const GetMset_data::Options& opts, Handle<Function> cb);
+  static void GetMset_deliver(GetMset_data* data, size_t caller, int begin, int end);
+  static std::string GetMset_key(Enquire* enq, uint32_t first, uint32_t max, const GetMset_data::Options& opts);
+  static Handle<Value> GetMset_options(Handle<Object> obj, GetMset_data::Options& opts);
+  static std::string GetMset_snippet(const std::string& text, const std::set<std::string>& terms, Xapian::Stem* stem, const GetMset_data::Options& opts);
 };
 
 class Query : public ObjectWrap {
@@ -214,8 +1319,7 @@ public:
   Xapian::Query mQry;
 
 protected:
-  template <class T>
-  Query(Xapian::Query::op o, T a, T b) : ObjectWrap(), mQry(o, a, b) {}
+  Query(const Xapian::Query& q) : ObjectWrap(), mQry(q) {}
 
   ~Query() {}
 
@@ -230,19 +1334,26 @@ public:
 
   static Persistent<FunctionTemplate> constructor_template;
 
-  Xapian::Document* getDoc() {
+  SharedDoc* getShared() {
     return mDoc;
   }
 
 protected:
-  Document(Xapian::Document* iDoc) : ObjectWrap(), mDoc(iDoc), mBusy(false) {}
+  Document(SharedDoc* iDoc, size_t iBytes, const std::string& iCacheKey)
+    : ObjectWrap(), mDoc(iDoc), mBusy(false), mBytes(iBytes), mCacheKey(iCacheKey) {
+    mDoc->ref();
+    trackMemory(eMemDocument, mBytes, 1);
+  }
 
   ~Document() {
-    delete mDoc;
+    mDoc->unref();
+    trackMemory(eMemDocument, -(long)mBytes, -1);
   }
 
-  Xapian::Document* mDoc;
+  SharedDoc* mDoc;
   bool mBusy;
+  size_t mBytes; // estimate reported to V8
+  std::string mCacheKey; // in sDocCache, empty if not cached
 
   friend struct AsyncOp<Document>;
 
@@ -256,6 +1367,27 @@ protected:
       : AsyncOp<Document>(ob, cb) {}
     std::string data;
   };
+
+  static Handle<Value> GetValues(const Arguments& args);
+  static int GetValues_pool(eio_req *req);
+  static int GetValues_done(eio_req *req);
+  struct GetValues_data : AsyncOp<Document> {
+    GetValues_data(Handle<Object> ob, Handle<Function> cb)
+      : AsyncOp<Document>(ob, cb) {}
+    std::vector<Xapian::valueno> slots; // empty for all
+    std::vector<std::pair<Xapian::valueno, std::string> > values;
+  };
+
+  static Handle<Value> GetTermlist(const Arguments& args);
+  static int GetTermlist_pool(eio_req *req);
+  static int GetTermlist_done(eio_req *req);
+  struct GetTermlist_data : AsyncOp<Document> {
+    GetTermlist_data(Handle<Object> ob, Handle<Function> cb, bool po)
+      : AsyncOp<Document>(ob, cb), withpositions(po) {}
+    bool withpositions;
+    std::vector<std::string> terms;
+    std::vector<uint32_t> wdf, offsets, positions;
+  };
 };
 
 class Mime2Text : public ObjectWrap {
@@ -281,55 +1413,142 @@ protected:
   static Handle<Value> Convert(const Arguments& args);
   static int Convert_pool(eio_req *req);
   static int Convert_done(eio_req *req);
-  struct Convert_data : AsyncOp<Mime2Text> {
+  struct Convert_data : AsyncOp<Mime2Text>, Slicer {
     Convert_data(Handle<Object> ob, Handle<Function> cb, Handle<String> fi, Handle<Value> ty)
-      : AsyncOp<Mime2Text>(ob, cb), filename(fi), type(ty->IsString() ? ty : Handle<Value>()) {}
+      : AsyncOp<Mime2Text>(ob, cb), filename(fi), type(ty->IsString() ? ty : Handle<Value>()), chunk(0), offset(0) {}
     String::Utf8Value filename;
     String::Utf8Value type;
     Xapian::Mime2Text::Fields fields;
+    size_t chunk; // body bytes per callback, 0 for all in one
+    size_t offset; // of the next body chunk
+    bool slice();
   };
 };
 
 static Handle<Value> AssembleDocument(const Arguments& args);
 static int Main_pool(eio_req *req);
 static int Main_done(eio_req *req);
-struct Main_data : public AsyncOpBase {
-  Main_data(Handle<Function> cb, Xapian::Document* doc, TermGenerator* tg, String::Utf8Value** tl, Mime2Text* m2t, Handle<Value> p, Handle<Value> m)
-    : AsyncOpBase(cb), document(doc), termgen(tg), textlist(tl), mime2text(m2t), path(p), mimetype(m) {
+struct Main_data : public AsyncOpBase, Recycled<Main_data> {
+  // all input text in one buffer, one segment per array element
+  struct Text {
+    struct Segment {
+      size_t offset, length;
+      std::string prefix;
+      Xapian::termcount weight;
+    };
+    void add(Handle<String> str, const std::string& prefix, Xapian::termcount weight) {
+      Segment aSeg;
+      aSeg.offset = buffer.size();
+      aSeg.length = str.IsEmpty() ? 0 : str->Utf8Length();
+      aSeg.prefix = prefix;
+      aSeg.weight = weight;
+      if (aSeg.length) {
+        buffer.resize(aSeg.offset + aSeg.length);
+        str->WriteUtf8(&buffer[aSeg.offset], aSeg.length);
+      }
+      segments.push_back(aSeg);
+    }
+    std::string buffer;
+    std::vector<Segment> segments;
+  };
+  static RecyclePool<Text> sText;
+  static void giveText(Text* text) {
+    if (text->buffer.capacity() > (1 << 20)) {
+      delete text;
+      return;
+    }
+    text->buffer.clear();
+    text->segments.clear();
+    sText.give(text);
+  }
+
+  Main_data(Handle<Function> cb, const Xapian::Document& doc, TermGenerator* tg, Text* tx, Mime2Text* m2t, Handle<Value> p, Handle<Value> m, Xapian::valueno ms=Xapian::BAD_VALUENO)
+    : AsyncOpBase(cb), document(doc), termgen(tg), text(tx), mime2text(m2t), path(p), mimetype(m), md5slot(ms), fieldbytes(0) {
     termgen->Ref();
+    termgen->mBusy = true;
     mime2text->Ref();
   }
   ~Main_data() {
-    if (textlist) {
-      for (int a=0; textlist[a]; ++a)
-        delete textlist[a];
-      delete [] textlist;
-    }
+    if (text)
+      giveText(text);
+    termgen->mBusy = false;
     termgen->Unref();
     mime2text->Unref();
   }
-  Xapian::Document* document;
+  Xapian::Document document;
   TermGenerator* termgen;
-  String::Utf8Value** textlist;
+  Text* text; // NULL for none
   Mime2Text* mime2text;
   String::Utf8Value path;
   String::Utf8Value mimetype;
+  Xapian::valueno md5slot;
   Xapian::Mime2Text::Fields fields;
+  FieldMap fieldmap;
+  size_t fieldbytes;
+};
+
+RecyclePool<Main_data::Text> Main_data::sText(16);
+
+static Handle<Value> SetPoolOptions(const Arguments& args);
+static Handle<Value> PoolStats(const Arguments& args);
+
+static Handle<Value> MemoryStats(const Arguments& args);
+static Handle<Value> SetMemoryLimit(const Arguments& args);
+static Handle<Value> SortableSerialise(const Arguments& args);
+static Handle<Value> SortableUnserialise(const Arguments& args);
+
+static Handle<Value> Compact(const Arguments& args);
+static int Compact_pool(eio_req *req);
+static int Compact_done(eio_req *req);
+struct Compact_data : public AsyncOpBase {
+  Compact_data(Handle<Function> cb, Handle<Value> d)
+    : AsyncOpBase(cb), destdir(d), blocksize(0), level(Xapian::Compactor::FULL), multipass(false), renumber(true),
+      open(false), progress(NULL), db(NULL) {}
+  ~Compact_data() {
+    if (progress) delete progress;
+    if (db) delete db;
+  }
+  std::vector<std::string> sources;
+  String::Utf8Value destdir;
+  size_t blocksize;
+  Xapian::Compactor::compaction_level level;
+  bool multipass, renumber, open;
+  ProgressQueue* progress;
+  Xapian::Database* db;
 };
 
 extern "C"
 void init (Handle<Object> target) {
   HandleScope scope;
+  atexit(stopExecutor);
   kBusyMsg = Persistent<String>::New(String::New("object busy with async op"));
   Database::Init(target);
   WritableDatabase::Init(target);
+  DatabaseReplica::Init(target);
   TermGenerator::Init(target);
   Stem::Init(target);
+  Weight::Init(target);
+  BoolWeight::Init(target);
+  BM25Weight::Init(target);
+  TradWeight::Init(target);
   Enquire::Init(target);
   Query::Init(target);
   Document::Init(target);
+  OpHandle::Init(target);
   Mime2Text::Init(target);
   target->Set(String::NewSymbol("assemble_document"), FunctionTemplate::New(AssembleDocument)->GetFunction());
+  target->Set(String::NewSymbol("set_pool_options"), FunctionTemplate::New(SetPoolOptions)->GetFunction());
+  target->Set(String::NewSymbol("pool_stats"), FunctionTemplate::New(PoolStats)->GetFunction());
+  target->Set(String::NewSymbol("memory_stats"), FunctionTemplate::New(MemoryStats)->GetFunction());
+  target->Set(String::NewSymbol("set_memory_limit"), FunctionTemplate::New(SetMemoryLimit)->GetFunction());
+  target->Set(String::NewSymbol("sortable_serialise"), FunctionTemplate::New(SortableSerialise)->GetFunction());
+  target->Set(String::NewSymbol("sortable_unserialise"), FunctionTemplate::New(SortableUnserialise)->GetFunction());
+
+  Handle<Object> aCompact = FunctionTemplate::New(Compact)->GetFunction();
+  aCompact->Set(String::NewSymbol("STANDARD"), Integer::New(Xapian::Compactor::STANDARD), ReadOnly);
+  aCompact->Set(String::NewSymbol("FULL"    ), Integer::New(Xapian::Compactor::FULL    ), ReadOnly);
+  aCompact->Set(String::NewSymbol("FULLER"  ), Integer::New(Xapian::Compactor::FULLER  ), ReadOnly);
+  target->Set(String::NewSymbol("compact"), aCompact);
 }
 
 static void tryCallCatch(Handle<Function> fn, Handle<Object> context, int argc, Handle<Value>* argv) {
@@ -341,6 +1560,23 @@ static void tryCallCatch(Handle<Function> fn, Handle<Object> context, int argc,
     FatalException(try_catch);
 }
 
+void ProgressQueue::flush() {
+  HandleScope scope;
+  std::vector<Record> aList;
+  pthread_mutex_lock(&lock);
+  aList.swap(pending);
+  pthread_mutex_unlock(&lock);
+  for (size_t a = 0; a < aList.size(); ++a) {
+    Local<Object> aO(Object::New());
+    for (size_t aS = 0; aS < aList[a].strings.size(); ++aS)
+      aO->Set(String::NewSymbol(aList[a].strings[aS].first), String::New(aList[a].strings[aS].second.data(), aList[a].strings[aS].second.size()));
+    for (size_t aN = 0; aN < aList[a].numbers.size(); ++aN)
+      aO->Set(String::NewSymbol(aList[a].numbers[aN].first), Number::New(aList[a].numbers[aN].second));
+    Handle<Value> argv[] = { aO };
+    tryCallCatch(callback, Context::GetCurrent()->Global(), 1, argv);
+  }
+}
+
 template <class T>
 static T* GetInstance(Handle<Value> val) {
   if (val->IsObject() && T::constructor_template->HasInstance(val->ToObject()))
@@ -348,7 +1584,47 @@ static T* GetInstance(Handle<Value> val) {
   return NULL;
 }
 
+// strings are stored as UTF-8 and Buffers as their bytes; numbers and Dates (as ms since
+// epoch) via sortable_serialise(), so that value ranges compare numerically
+static bool valueString(Handle<Value> val, std::string& out) {
+  if (val->IsString())
+    out = *String::Utf8Value(val);
+  else if (Buffer::HasInstance(val))
+    out.assign(Buffer::Data(val->ToObject()), Buffer::Length(val->ToObject()));
+  else if (val->IsNumber() || val->IsDate())
+    out = Xapian::sortable_serialise(val->NumberValue());
+  else
+    return false;
+  return true;
+}
+
+// values may be binary, e.g. sortable_serialise()d numbers or md5s, so they go back as Buffers
+static Handle<Object> newValueBuffer(const std::string& value) {
+  return Buffer::New((char*) value.data(), value.size())->handle_;
+}
+
+/*
+sortable_serialise(number) // returns a Buffer, as Xapian::sortable_serialise()
+sortable_unserialise(Buffer|string) // returns a number, e.g. from a value stored as a number or Date
+*/
+
+static Handle<Value> SortableSerialise(const Arguments& args) {
+  HandleScope scope;
+  if (args.Length() < 1 || !args[0]->IsNumber())
+    return ThrowException(Exception::TypeError(String::New("arguments are (number)")));
+  return scope.Close(newValueBuffer(Xapian::sortable_serialise(args[0]->NumberValue())));
+}
+
+static Handle<Value> SortableUnserialise(const Arguments& args) {
+  HandleScope scope;
+  std::string aValue;
+  if (args.Length() < 1 || !(args[0]->IsString() || Buffer::HasInstance(args[0])) || !valueString(args[0], aValue))
+    return ThrowException(Exception::TypeError(String::New("arguments are (Buffer|string)")));
+  return scope.Close(Number::New(Xapian::sortable_unserialise(aValue)));
+}
+
 Persistent<FunctionTemplate> Database::constructor_template;
+unsigned Database::sSerials = 0;
 
 void Database::Init(Handle<Object> target) {
   constructor_template = Persistent<FunctionTemplate>::New(FunctionTemplate::New(New));
@@ -358,40 +1634,446 @@ void Database::Init(Handle<Object> target) {
 
   NODE_SET_PROTOTYPE_METHOD(constructor_template, "reopen", Reopen);
   NODE_SET_PROTOTYPE_METHOD(constructor_template, "add_database", AddDatabase);
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "warm", Warm);
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "snapshot", Snapshot);
 
   target->Set(String::NewSymbol("Database"), constructor_template->GetFunction());
+  target->Set(String::NewSymbol("open_databases"), FunctionTemplate::New(OpenDatabases)->GetFunction());
+  target->Set(String::NewSymbol("set_handle_cache"), FunctionTemplate::New(SetHandleCache)->GetFunction());
+  target->Set(String::NewSymbol("set_document_cache"), FunctionTemplate::New(SetDocumentCache)->GetFunction());
+  target->Set(String::NewSymbol("document_cache_stats"), FunctionTemplate::New(DocumentCacheStats)->GetFunction());
+}
+
+Local<Object> Database::NewInstance(Xapian::Database* db, const std::vector<std::string>& paths) {
+  Local<Value> aDb[] = { External::New(db) };
+  Local<Object> aO = constructor_template->GetFunction()->NewInstance(1, aDb);
+  ObjectWrap::Unwrap<Database>(aO)->mPaths = paths;
+  return aO;
+}
+
+/*
+open options object: {
+  inmemory: boolean // load the on-disk index into an InMemory database; see also snapshot()
+}
+*/
+
+Handle<Value> Database::Open_options(const Arguments& args, int index, bool* inmemory) {
+  *inmemory = false;
+  if (args.Length() <= index)
+    return Handle<Value>();
+  if (!args[index]->IsObject())
+    return Exception::TypeError(String::New("open options not an object"));
+  Local<Object> aO = args[index]->ToObject();
+  Local<String> aKey;
+  if (aO->Has(aKey = String::New("inmemory"))) {
+    Local<Value> aVal = aO->Get(aKey);
+    if (!aVal->IsBoolean())
+      return Exception::TypeError(String::New("open options inmemory not a boolean"));
+    *inmemory = aVal->BooleanValue();
+  }
+  return Handle<Value>();
 }
 
 Handle<Value> Database::New(const Arguments& args) {
   HandleScope scope;
 
-  if (args.Length() < 1 || !args[0]->IsString())
-    return ThrowException(Exception::TypeError(String::New("arguments are (string)")));
+  if (args.Length() < 1 || !(args[0]->IsString() || args[0]->IsExternal()))
+    return ThrowException(Exception::TypeError(String::New("arguments are (string, [object])")));
+  bool aInMemory;
+  Handle<Value> aErr = Open_options(args, 1, &aInMemory);
+  if (!aErr.IsEmpty())
+    return ThrowException(aErr);
 
   Database* that = new Database();
   that->Wrap(args.This());
 
-  eio_custom(Open_pool, EIO_PRI_DEFAULT, Open_done, new Open_data(args.This(), args[0]->ToString()));
+  if (args[0]->IsExternal()) { // already open, so no 'open' event
+    that->mDb = (Xapian::Database*) External::Unwrap(args[0]);
+    return args.This();
+  }
+
+  sExecutor.submit(Open_pool, Open_done, new Open_data(args.This(), args[0]->ToString(), 0, aInMemory));
 
   return args.This();
 }
 
+/*
+set_handle_cache(max_fds)
+  keep collected read-only Databases open for reuse by new Database(path), within
+  a budget of max_fds (estimated per handle); 0, the default, closes them at once
+  a Database is collected only once its Enquires and get_mset() Documents are, and
+  handles given to add_database() stay counted until the combined Database closes
+*/
+
+Handle<Value> Database::SetHandleCache(const Arguments& args) {
+  HandleScope scope;
+  if (args.Length() < 1 || !args[0]->IsUint32())
+    return ThrowException(Exception::TypeError(String::New("arguments are (number)")));
+  sHandleCache.configure(args[0]->Uint32Value());
+  return Undefined();
+}
+
+/*
+set_document_cache(max_bytes, [slots])
+  cache the data, and values in slots, of documents from read-only Databases which
+  get_data(), get_values() or get_mset() read; 0, the default, disables it
+*/
+
+Handle<Value> Database::SetDocumentCache(const Arguments& args) {
+  HandleScope scope;
+  if (args.Length() < 1 || !args[0]->IsNumber() || args[0]->NumberValue() < 0 || (args.Length() > 1 && !args[1]->IsArray()))
+    return ThrowException(Exception::TypeError(String::New("arguments are (number, [array])")));
+  std::vector<Xapian::valueno> aSlots;
+  if (args.Length() > 1) {
+    Local<Array> aList = Local<Array>::Cast(args[1]);
+    for (uint32_t a = 0; a < aList->Length(); ++a) {
+      if (!aList->Get(a)->IsUint32())
+        return ThrowException(Exception::TypeError(String::New("slots list member not a number")));
+      aSlots.push_back(aList->Get(a)->Uint32Value());
+    }
+  }
+  sDocCache.configure((size_t) args[0]->NumberValue(), aSlots);
+  return Undefined();
+}
+
+Handle<Value> Database::DocumentCacheStats(const Arguments& args) {
+  HandleScope scope;
+  Local<Object> aStats(Object::New());
+  pthread_mutex_lock(&sDocCache.lock);
+  double aLookups = sDocCache.hits + sDocCache.misses;
+  aStats->Set(String::NewSymbol("entries"  ), Number::New(sDocCache.index.size()));
+  aStats->Set(String::NewSymbol("bytes"    ), Number::New(sDocCache.bytes));
+  aStats->Set(String::NewSymbol("max_bytes"), Number::New(sDocCache.maxbytes));
+  aStats->Set(String::NewSymbol("hits"     ), Number::New(sDocCache.hits));
+  aStats->Set(String::NewSymbol("misses"   ), Number::New(sDocCache.misses));
+  aStats->Set(String::NewSymbol("hit_rate" ), Number::New(aLookups ? sDocCache.hits / aLookups : 0));
+  aStats->Set(String::NewSymbol("evictions"), Number::New(sDocCache.evictions));
+  pthread_mutex_unlock(&sDocCache.lock);
+  return scope.Close(aStats);
+}
+
+/*
+open_databases(paths, function)
+  open each path concurrently in the pool, then combine them as with add_database()
+  function(err, db)
+*/
+
+Handle<Value> Database::OpenDatabases(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() < 2 || !args[0]->IsArray() || !args[1]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (array, function)")));
+  Local<Array> aPaths = Local<Array>::Cast(args[0]);
+  if (aPaths->Length() == 0)
+    return ThrowException(Exception::TypeError(String::New("paths list is empty")));
+  for (uint32_t a = 0; a < aPaths->Length(); ++a)
+    if (!aPaths->Get(a)->IsString())
+      return ThrowException(Exception::TypeError(String::New("paths list member not a string")));
+
+  OpenDatabases_data* aData = new OpenDatabases_data(Local<Function>::Cast(args[1]), aPaths->Length());
+  for (uint32_t a = 0; a < aPaths->Length(); ++a)
+    aData->paths.push_back(*String::Utf8Value(aPaths->Get(a)));
+  for (uint32_t a = 0; a < aPaths->Length(); ++a) {
+    OpenShard_data* aShard = new OpenShard_data;
+    aShard->group = aData;
+    aShard->index = a;
+    sExecutor.submit(OpenShard_pool, OpenShard_done, aShard);
+  }
+
+  return Undefined();
+}
+
+int Database::OpenShard_pool(eio_req *req) {
+  OpenShard_data* aShard = (OpenShard_data*) req->data;
+  OpenDatabases_data* aData = aShard->group;
+
+  try {
+    aData->shards[aShard->index] = new Xapian::Database(aData->paths[aShard->index]);
+  } catch (const Xapian::Error& err) {
+    aData->errors[aShard->index] = new Xapian::Error(err);
+  }
+
+  return 0;
+}
+
+int Database::OpenShard_done(eio_req *req) {
+  HandleScope scope;
+
+  OpenShard_data* aShard = (OpenShard_data*) req->data;
+  OpenDatabases_data* aData = aShard->group;
+  delete aShard;
+  if (--aData->pending)
+    return 0;
+
+  Xapian::Database* aDb = NULL;
+  for (size_t a = 0; a < aData->errors.size() && !aData->error; ++a) {
+    aData->error = aData->errors[a];
+    aData->errors[a] = NULL;
+  }
+  if (!aData->error) {
+    try {
+      aDb = new Xapian::Database;
+      for (size_t a = 0; a < aData->shards.size(); ++a)
+        aDb->add_database(*aData->shards[a]);
+    } catch (const Xapian::Error& err) {
+      aData->error = new Xapian::Error(err);
+      delete aDb;
+    }
+  }
+
+  Handle<Value> argv[2];
+  if (aData->error) {
+    argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
+  } else {
+    argv[0] = Null();
+    argv[1] = NewInstance(aDb, aData->paths);
+  }
+
+  tryCallCatch(aData->callback, Context::GetCurrent()->Global(), aData->error ? 1 : 2, argv);
+
+  delete aData;
+
+  return 0;
+}
+
 Handle<Value> Database::AddDatabase(const Arguments& args) {
   HandleScope scope;
   Database* aDb;
   if (args.Length() < 1 || !(aDb = GetInstance<Database>(args[0])))
     return ThrowException(Exception::TypeError(String::New("arguments are (Database)")));
   Database* that = ObjectWrap::Unwrap<Database>(args.This());
-  if (that->mBusy)
+  if (that->mBusy || aDb->mBusy)
     return ThrowException(Exception::Error(kBusyMsg));
   try {
   that->mDb->add_database(*aDb->mDb);
   } catch (const Xapian::Error& err) {
     return ThrowException(Exception::Error(String::New(err.get_msg().c_str())));
   }
+  // neither is reused or evicted now, but their fds stay counted until that is closed
+  that->mCached = false;
+  aDb->mCached = false;
+  that->mCounted += aDb->mCounted;
+  aDb->mCounted = 0;
+  aDb->mMerged = true;
+  that->mPaths.insert(that->mPaths.end(), aDb->mPaths.begin(), aDb->mPaths.end());
+  ++that->mGeneration;
+  return Undefined();
+}
+
+/*
+warm(options, function)
+  options: {
+    // all members optional
+    tables: [ string, ... ], // default [ 'postlist', 'termlist', 'record' ]
+    read: boolean, // default true, read the tables through; false only advises the kernel
+    top_terms: number // also walk the postlists of the N terms with highest termfreq
+  }
+  function(err, result) // result { bytes: number, files: number, postings: number, ms: number }
+*/
+
+Handle<Value> Database::Warm(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() < 2 || !args[0]->IsObject() || !args[1]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (object, function)")));
+  Local<Object> aO = args[0]->ToObject();
+  Local<String> aKey;
+  Local<Value> aVal;
+  std::vector<std::string> aTables;
+  bool aRead = true;
+  uint32_t aTop = 0;
+  if (aO->Has(aKey = String::New("tables"))) {
+    aVal = aO->Get(aKey);
+    if (!aVal->IsArray())
+      return ThrowException(Exception::TypeError(String::New("options object tables not an array")));
+    Local<Array> aAry = Local<Array>::Cast(aVal);
+    for (uint32_t a = 0; a < aAry->Length(); ++a) {
+      String::Utf8Value aName(aAry->Get(a));
+      if (!aAry->Get(a)->IsString() || strchr(*aName, '/'))
+        return ThrowException(Exception::TypeError(String::New("options object tables member not a table name")));
+      aTables.push_back(*aName);
+    }
+  } else {
+    const char* aDefault[] = { "postlist", "termlist", "record" };
+    aTables.assign(aDefault, aDefault + 3);
+  }
+  if (aO->Has(aKey = String::New("read"))) {
+    aVal = aO->Get(aKey);
+    if (!aVal->IsBoolean())
+      return ThrowException(Exception::TypeError(String::New("options object read not a boolean")));
+    aRead = aVal->BooleanValue();
+  }
+  if (aO->Has(aKey = String::New("top_terms"))) {
+    aVal = aO->Get(aKey);
+    if (!aVal->IsUint32())
+      return ThrowException(Exception::TypeError(String::New("options object top_terms not a number")));
+    aTop = aVal->Uint32Value();
+  }
+
+  Database* that = ObjectWrap::Unwrap<Database>(args.This());
+  Warm_data* aData;
+  try {
+    aData = new Warm_data(args.This(), Local<Function>::Cast(args[1]), that->mPaths);
+  } catch (Local<Value> ex) {
+    return ThrowException(ex);
+  }
+  aData->tables.swap(aTables);
+  aData->read = aRead;
+  aData->topterms = aTop;
+
+  sExecutor.submit(Warm_pool, Warm_done, aData);
+
+  return Undefined();
+}
+
+int Database::Warm_pool(eio_req *req) {
+  Warm_data* aData = (Warm_data*) req->data;
+  double aStart = nowSeconds();
+
+  std::vector<char> aBuf(aData->read ? 1 << 20 : 0);
+  for (size_t aP = 0; aP < aData->paths.size(); ++aP) {
+    for (size_t aT = 0; aT < aData->tables.size(); ++aT) {
+      std::string aFile(aData->paths[aP] + "/" + aData->tables[aT] + ".DB");
+      int aFd = open(aFile.c_str(), O_RDONLY);
+      if (aFd < 0)
+        continue; // not all tables exist in every database
+      struct stat aSt;
+      if (fstat(aFd, &aSt) == 0) {
+        posix_fadvise(aFd, 0, 0, POSIX_FADV_WILLNEED);
+        ++aData->files;
+        if (!aData->read) {
+          aData->bytes += aSt.st_size;
+        } else {
+          ssize_t aLen;
+          off_t aOff = 0;
+          while ((aLen = pread(aFd, &aBuf[0], aBuf.size(), aOff)) > 0) {
+            aOff += aLen;
+            aData->bytes += aLen;
+          }
+        }
+      }
+      close(aFd);
+    }
+  }
+
+  try {
+  if (aData->topterms) {
+    typedef std::pair<Xapian::doccount, std::string> Freq;
+    std::priority_queue<Freq, std::vector<Freq>, std::greater<Freq> > aTop; // least frequent on top
+    Xapian::Database& aDb = *aData->object->mDb;
+    for (Xapian::TermIterator a = aDb.allterms_begin(); a != aDb.allterms_end(); ++a) {
+      if (aTop.size() < aData->topterms) {
+        aTop.push(Freq(a.get_termfreq(), *a));
+      } else if (a.get_termfreq() > aTop.top().first) {
+        aTop.pop();
+        aTop.push(Freq(a.get_termfreq(), *a));
+      }
+    }
+    for (; !aTop.empty(); aTop.pop()) {
+      for (Xapian::PostingIterator a = aDb.postlist_begin(aTop.top().second); a != aDb.postlist_end(aTop.top().second); ++a) {
+        a.get_wdf();
+        ++aData->postings;
+      }
+    }
+  }
+  } catch (const Xapian::Error& err) {
+    aData->error = new Xapian::Error(err);
+  }
+  aData->seconds = nowSeconds() - aStart;
+
+  aData->poolDone();
+  return 0;
+}
+
+int Database::Warm_done(eio_req *req) {
+  HandleScope scope;
+
+  Warm_data* aData = (Warm_data*) req->data;
+
+  Handle<Value> argv[2];
+  if (aData->error) {
+    argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
+  } else {
+    argv[0] = Null();
+    Local<Object> aO(Object::New());
+    aO->Set(String::NewSymbol("bytes"   ), Number::New(aData->bytes));
+    aO->Set(String::NewSymbol("files"   ), Uint32::New(aData->files));
+    aO->Set(String::NewSymbol("postings"), Uint32::New(aData->postings));
+    aO->Set(String::NewSymbol("ms"      ), Number::New(aData->seconds * 1000));
+    argv[1] = aO;
+  }
+
+  tryCallCatch(aData->callback, aData->object->handle_, aData->error ? 1 : 2, argv);
+
+  delete aData;
+
+  return 0;
+}
+
+static void copyDatabase(const Xapian::Database& src, Xapian::WritableDatabase& dst) {
+  for (Xapian::PostingIterator a = src.postlist_begin(""); a != src.postlist_end(""); ++a)
+    dst.replace_document(*a, src.get_document(*a));
+  for (Xapian::TermIterator a = src.metadata_keys_begin(); a != src.metadata_keys_end(); ++a)
+    dst.set_metadata(*a, src.get_metadata(*a));
+  try {
+    for (Xapian::TermIterator a = src.spellings_begin(); a != src.spellings_end(); ++a)
+      dst.add_spelling(*a, a.get_termfreq());
+    for (Xapian::TermIterator a = src.synonym_keys_begin(); a != src.synonym_keys_end(); ++a)
+      for (Xapian::TermIterator aS = src.synonyms_begin(*a); aS != src.synonyms_end(*a); ++aS)
+        dst.add_synonym(*a, *aS);
+  } catch (const Xapian::UnimplementedError& err) {
+    // InMemory has no spelling or synonym tables
+  }
+}
+
+Handle<Value> Database::Snapshot(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() < 2 || !args[0]->IsString() || !args[1]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (string, function)")));
+  Snapshot_data* aData;
+  try {
+    aData = new Snapshot_data(args.This(), Local<Function>::Cast(args[1]), args[0]->ToString());
+  } catch (Local<Value> ex) {
+    return ThrowException(ex);
+  }
+
+  sExecutor.submit(Snapshot_pool, Snapshot_done, aData);
+
   return Undefined();
 }
 
+int Database::Snapshot_pool(eio_req *req) {
+  Snapshot_data* aData = (Snapshot_data*) req->data;
+
+  try {
+    Xapian::WritableDatabase aOut(*aData->filename, Xapian::DB_CREATE_OR_OVERWRITE);
+    copyDatabase(*aData->object->mDb, aOut);
+    aOut.commit();
+  } catch (const Xapian::Error& err) {
+    aData->error = new Xapian::Error(err);
+  }
+
+  aData->poolDone();
+  return 0;
+}
+
+int Database::Snapshot_done(eio_req *req) {
+  HandleScope scope;
+
+  Snapshot_data* aData = (Snapshot_data*) req->data;
+
+  Handle<Value> argv[1];
+  if (aData->error)
+    argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
+
+  tryCallCatch(aData->callback, aData->object->handle_, aData->error ? 1 : 0, argv);
+
+  delete aData;
+
+  return 0;
+}
+
 Handle<Value> Database::Reopen(const Arguments& args) {
   HandleScope scope;
 
@@ -402,7 +2084,7 @@ Handle<Value> Database::Reopen(const Arguments& args) {
     return ThrowException(ex);
   }
 
-  eio_custom(Open_pool, EIO_PRI_DEFAULT, Open_done, aData);
+  sExecutor.submit(Open_pool, Open_done, aData);
 
   return Undefined();
 }
@@ -410,13 +2092,45 @@ Handle<Value> Database::Reopen(const Arguments& args) {
 int Database::Open_pool(eio_req *req) {
   Open_data* aData = (Open_data*) req->data;
 
+  bool aCache = false;
   try {
-  if (aData->object->mDb)
+  if (aData->object->mDb) {
     aData->object->mDb->reopen();
-  else
-    aData->object->mDb = aData->writeopts ? new Xapian::WritableDatabase(*aData->filename, aData->writeopts) : new Xapian::Database(*aData->filename);
+  } else if (aData->inmemory) {
+    Xapian::WritableDatabase* aMem = new Xapian::WritableDatabase(Xapian::InMemory::open());
+    try {
+      if (aData->filename.length())
+        copyDatabase(Xapian::Database(*aData->filename), *aMem);
+    } catch (const Xapian::Error& err) {
+      delete aMem;
+      throw;
+    }
+    aData->object->mDb = aMem;
+  } else if (aData->writeopts) {
+    aData->object->mDb = new Xapian::WritableDatabase(*aData->filename, aData->writeopts);
+    aData->object->mPaths.push_back(*aData->filename);
+  } else {
+    if (sHandleCache.enabled()) {
+      aCache = true;
+      aData->object->mDb = sHandleCache.take(*aData->filename);
+    }
+    if (aData->object->mDb)
+      aData->object->mDb->reopen();
+    else
+      aData->object->mDb = new Xapian::Database(*aData->filename);
+    aData->object->mCached = aCache;
+    aData->object->mCounted = aCache ? 1 : 0;
+    aData->object->mPaths.push_back(*aData->filename);
+  }
   } catch (const Xapian::Error& err) {
     aData->error = new Xapian::Error(err);
+    if (aCache && !aData->object->mCached) {
+      if (aData->object->mDb) { // failed reopen of a cached handle
+        delete aData->object->mDb;
+        aData->object->mDb = NULL;
+      }
+      sHandleCache.drop();
+    }
   }
 
   aData->poolDone();
@@ -431,6 +2145,7 @@ int Database::Open_done(eio_req *req) {
   Handle<Value> argv[1];
   if (aData->error)
     argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
+  ++aData->object->mGeneration;
 
   aData->object->Emit(String::New("open"), aData->error ? 1 : 0, argv);
 
@@ -448,9 +2163,13 @@ void WritableDatabase::Init(Handle<Object> target) {
   constructor_template->SetClassName(String::NewSymbol("WritableDatabase"));
 
   NODE_SET_PROTOTYPE_METHOD(constructor_template, "replace_document", ReplaceDocument);
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "delete_documents", DeleteDocuments);
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "write_changesets_to_fd", WriteChangesets);
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "add_replica", AddReplica);
   NODE_SET_PROTOTYPE_METHOD(constructor_template, "commit", Commit);
   NODE_SET_PROTOTYPE_METHOD(constructor_template, "begin_transaction", BeginTransaction);
   NODE_SET_PROTOTYPE_METHOD(constructor_template, "commit_transaction", CommitTransaction);
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "index_directory", IndexDirectory);
 
   target->Set(String::NewSymbol("DB_OPEN"               ), Integer::New(Xapian::DB_OPEN               ), ReadOnly);
   target->Set(String::NewSymbol("DB_CREATE"             ), Integer::New(Xapian::DB_CREATE             ), ReadOnly);
@@ -458,18 +2177,25 @@ void WritableDatabase::Init(Handle<Object> target) {
   target->Set(String::NewSymbol("DB_CREATE_OR_OVERWRITE"), Integer::New(Xapian::DB_CREATE_OR_OVERWRITE), ReadOnly);
 
   target->Set(String::NewSymbol("WritableDatabase"), constructor_template->GetFunction());
+  target->Set(String::NewSymbol("set_max_changesets"), FunctionTemplate::New(SetMaxChangesets)->GetFunction());
 }
 
 Handle<Value> WritableDatabase::New(const Arguments& args) {
   HandleScope scope;
 
-  if (args.Length() < 2 || !args[0]->IsString() || !args[1]->IsInt32())
-    return ThrowException(Exception::TypeError(String::New("arguments are (string, number)")));
+  if (args.Length() < 2 || !(args[0]->IsString() || args[0]->IsNull()) || !args[1]->IsInt32())
+    return ThrowException(Exception::TypeError(String::New("arguments are (string|null, number, [object])")));
+  bool aInMemory;
+  Handle<Value> aErr = Open_options(args, 2, &aInMemory);
+  if (!aErr.IsEmpty())
+    return ThrowException(aErr);
 
   WritableDatabase* that = new WritableDatabase();
   that->Wrap(args.This());
 
-  eio_custom(Open_pool, EIO_PRI_DEFAULT, Open_done, new Open_data(args.This(), args[0]->ToString(), args[1]->Int32Value()));
+  // a null path gives an empty InMemory database
+  Handle<String> aPath = args[0]->IsNull() ? Handle<String>() : args[0]->ToString();
+  sExecutor.submit(Open_pool, Open_done, new Open_data(args.This(), aPath, args[1]->Int32Value(), aInMemory || args[0]->IsNull()));
 
   return args.This();
 }
@@ -483,12 +2209,12 @@ Handle<Value> WritableDatabase::ReplaceDocument(const Arguments& args) {
 
   AddDocument_data* aData;
   try {
-    aData = new AddDocument_data(args.This(), Local<Function>::Cast(args[2]), *aDoc->getDoc(), args[0]->ToString());
+    aData = new AddDocument_data(args.This(), Local<Function>::Cast(args[2]), aDoc->getShared(), args[0]->ToString());
   } catch (Local<Value> ex) {
     return ThrowException(ex);
   }
 
-  eio_custom(AddDocument_pool, EIO_PRI_DEFAULT, AddDocument_done, aData);
+  sExecutor.submit(AddDocument_pool, AddDocument_done, aData);
 
   return Undefined();
 }
@@ -496,11 +2222,12 @@ Handle<Value> WritableDatabase::ReplaceDocument(const Arguments& args) {
 int WritableDatabase::AddDocument_pool(eio_req *req) {
   AddDocument_data* aData = (AddDocument_data*) req->data;
 
+  SharedDocLock aLock(aData->document);
   try {
     if (aData->idterm.length())
-      aData->docid = aData->object->mWdb->replace_document(*aData->idterm, aData->document);
+      aData->docid = aData->object->mWdb->replace_document(*aData->idterm, aData->document->doc);
     else
-      aData->docid = aData->object->mWdb->add_document(aData->document);
+      aData->docid = aData->object->mWdb->add_document(aData->document->doc);
   } catch (const Xapian::Error& err) {
     aData->error = new Xapian::Error(err);
   }
@@ -529,41 +2256,189 @@ int WritableDatabase::AddDocument_done(eio_req *req) {
   return 0;
 }
 
-Handle<Value> WritableDatabase::Commit(const Arguments& args) {
+/*
+delete_documents(list, [options,] function)
+  list: [ id_term/docid, ... ] or Query // for a Query, every matching document, deleted 1000 at a time
+  options: { transaction: boolean } // wrap in begin_transaction()/commit_transaction()
+  function(err, count) // count of documents removed
+*/
+
+Handle<Value> WritableDatabase::DeleteDocuments(const Arguments& args) {
   HandleScope scope;
 
-  if (args.Length() < 1 || !args[0]->IsFunction())
-    return ThrowException(Exception::TypeError(String::New("arguments are (function)")));
-  Commit_data* aData;
+  int aCb = args.Length() > 2 ? 2 : 1;
+  Query* aQ = args.Length() ? GetInstance<Query>(args[0]) : NULL;
+  if (args.Length() < 2 || !(aQ || args[0]->IsArray()) || (aCb == 2 && !args[1]->IsObject()) || !args[aCb]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (array|Query, [object,] function)")));
+  bool aTx = false;
+  if (aCb == 2) {
+    Local<Object> aOpts = args[1]->ToObject();
+    Local<String> aKey;
+    if (aOpts->Has(aKey = String::New("transaction"))) {
+      Local<Value> aVal = aOpts->Get(aKey);
+      if (!aVal->IsBoolean())
+        return ThrowException(Exception::TypeError(String::New("options object transaction not a boolean")));
+      aTx = aVal->BooleanValue();
+    }
+  }
+  std::vector<std::string> aTerms;
+  std::vector<Xapian::docid> aIds;
+  if (!aQ) {
+    Local<Array> aAry = Local<Array>::Cast(args[0]);
+    for (uint32_t a = 0; a < aAry->Length(); ++a) {
+      Local<Value> aVal = aAry->Get(a);
+      if (aVal->IsString())
+        aTerms.push_back(*String::Utf8Value(aVal));
+      else if (aVal->IsUint32() && aVal->Uint32Value())
+        aIds.push_back(aVal->Uint32Value());
+      else
+        return ThrowException(Exception::TypeError(String::New("list member not an id_term or docid")));
+    }
+  }
+  DeleteDocuments_data* aData;
   try {
-    aData = new Commit_data(args.This(), Local<Function>::Cast(args[0]), Commit_data::eCommit);
+    aData = new DeleteDocuments_data(args.This(), Local<Function>::Cast(args[aCb]), aTx);
   } catch (Local<Value> ex) {
     return ThrowException(ex);
   }
+  aData->idterms.swap(aTerms);
+  aData->docids.swap(aIds);
+  if (aQ) {
+    aData->query = aQ->mQry;
+    aData->usequery = true;
+  }
 
-  eio_custom(Commit_pool, EIO_PRI_DEFAULT, Commit_done, aData);
+  sExecutor.submit(DeleteDocuments_pool, DeleteDocuments_done, aData);
 
   return Undefined();
 }
 
-Handle<Value> WritableDatabase::BeginTransaction(const Arguments& args) {
-  HandleScope scope;
+int WritableDatabase::DeleteDocuments_pool(eio_req *req) {
+  DeleteDocuments_data* aData = (DeleteDocuments_data*) req->data;
+  Xapian::WritableDatabase& aWdb = *aData->object->mWdb;
+  bool aInTx = false;
 
-  if (args.Length() < 2 || !args[0]->IsBoolean() || !args[1]->IsFunction())
-    return ThrowException(Exception::TypeError(String::New("arguments are (boolean, function)")));
-  Commit_data* aData;
   try {
-    aData = new Commit_data(args.This(), Local<Function>::Cast(args[1]), Commit_data::eBeginTx, args[0]->BooleanValue());
-  } catch (Local<Value> ex) {
-    return ThrowException(ex);
+  if (aData->transaction) {
+    aWdb.begin_transaction();
+    aInTx = true;
+  }
+  if (aData->usequery) {
+    // delete the matches a chunk at a time, rather than hold one MSet of them all;
+    // the WritableDatabase sees its own deletions, so each chunk starts at offset 0
+    static const Xapian::doccount kChunk = 1000;
+    Xapian::Enquire aEnq(aWdb);
+    aEnq.set_query(aData->query);
+    aEnq.set_weighting_scheme(Xapian::BoolWeight());
+    aEnq.set_docid_order(Xapian::Enquire::ASCENDING);
+    for (;;) {
+      Xapian::MSet aSet = aEnq.get_mset(0, kChunk);
+      Xapian::doccount aDeleted = 0;
+      for (Xapian::MSetIterator a = aSet.begin(); a != aSet.end(); ++a) {
+        try {
+          aWdb.delete_document(*a);
+          ++aDeleted;
+        } catch (const Xapian::DocNotFoundError& err) {
+        }
+      }
+      aData->count += aDeleted;
+      if (aSet.size() < kChunk || aDeleted == 0)
+        break;
+    }
+  }
+  for (size_t a = 0; a < aData->idterms.size(); ++a) {
+    aData->count += aWdb.get_termfreq(aData->idterms[a]);
+    aWdb.delete_document(aData->idterms[a]);
+  }
+  for (size_t a = 0; a < aData->docids.size(); ++a) {
+    try {
+      aWdb.delete_document(aData->docids[a]);
+      ++aData->count;
+    } catch (const Xapian::DocNotFoundError& err) {
+    }
+  }
+  if (aInTx) {
+    aInTx = false;
+    aWdb.commit_transaction();
+  }
+  } catch (const Xapian::Error& err) {
+    aData->error = new Xapian::Error(err);
+    if (aInTx) {
+      try {
+        aWdb.cancel_transaction();
+      } catch (const Xapian::Error& err) {
+      }
+    }
   }
 
-  eio_custom(Commit_pool, EIO_PRI_DEFAULT, Commit_done, aData);
+  aData->poolDone();
+  return 0;
+}
+
+int WritableDatabase::DeleteDocuments_done(eio_req *req) {
+  HandleScope scope;
 
-  return Undefined();
+  DeleteDocuments_data* aData = (DeleteDocuments_data*) req->data;
+
+  Handle<Value> argv[2];
+  if (aData->error) {
+    argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
+  } else {
+    argv[0] = Null();
+    argv[1] = Integer::New(aData->count);
+  }
+
+  tryCallCatch(aData->callback, aData->object->handle_, aData->error ? 1 : 2, argv);
+
+  delete aData;
+
+  return 0;
 }
 
-Handle<Value> WritableDatabase::CommitTransaction(const Arguments& args) {
+Handle<Value> WritableDatabase::Commit(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() < 1 || !args[0]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (function)")));
+  // writes can't run while a commit holds the database busy, so a caller's
+  // writes are covered by any commit that hasn't finished; it shares that fsync
+  WritableDatabase* that = ObjectWrap::Unwrap<WritableDatabase>(args.This());
+  if (that->mCommit && !that->mCommit->finished) {
+    that->mCommit->addWaiter(Local<Function>::Cast(args[0]), args.This());
+    return Undefined();
+  }
+  Commit_data* aData;
+  try {
+    aData = new Commit_data(args.This(), Local<Function>::Cast(args[0]), Commit_data::eCommit);
+  } catch (Local<Value> ex) {
+    return ThrowException(ex);
+  }
+  that->mCommit = aData;
+  that->holdReplicas(aData);
+
+  sExecutor.submit(Commit_pool, Commit_done, aData);
+
+  return Undefined();
+}
+
+Handle<Value> WritableDatabase::BeginTransaction(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() < 2 || !args[0]->IsBoolean() || !args[1]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (boolean, function)")));
+  Commit_data* aData;
+  try {
+    aData = new Commit_data(args.This(), Local<Function>::Cast(args[1]), Commit_data::eBeginTx, args[0]->BooleanValue());
+  } catch (Local<Value> ex) {
+    return ThrowException(ex);
+  }
+
+  sExecutor.submit(Commit_pool, Commit_done, aData);
+
+  return Undefined();
+}
+
+Handle<Value> WritableDatabase::CommitTransaction(const Arguments& args) {
   HandleScope scope;
 
   if (args.Length() < 1 || !args[0]->IsFunction())
@@ -574,8 +2449,9 @@ Handle<Value> WritableDatabase::CommitTransaction(const Arguments& args) {
   } catch (Local<Value> ex) {
     return ThrowException(ex);
   }
+  ObjectWrap::Unwrap<WritableDatabase>(args.This())->holdReplicas(aData);
 
-  eio_custom(Commit_pool, EIO_PRI_DEFAULT, Commit_done, aData);
+  sExecutor.submit(Commit_pool, Commit_done, aData);
 
   return Undefined();
 }
@@ -593,20 +2469,332 @@ int WritableDatabase::Commit_pool(eio_req *req) {
     aData->error = new Xapian::Error(err);
   }
 
+  // before releasing the database, so no later write or commit overtakes this revision's changesets
+  publishChangesets(aData);
+  aData->finished = true;
   aData->poolDone();
   return 0;
 }
 
+static Local<Object> replicationInfo(const Xapian::ReplicationInfo& info) {
+  Local<Object> aO(Object::New());
+  aO->Set(String::NewSymbol("changeset_count"), Integer::New(info.changeset_count));
+  aO->Set(String::NewSymbol("fullcopy_count" ), Integer::New(info.fullcopy_count ));
+  aO->Set(String::NewSymbol("changed"        ), Boolean::New(info.changed       ));
+  return aO;
+}
+
 int WritableDatabase::Commit_done(eio_req *req) {
   HandleScope scope;
 
   Commit_data* aData = (Commit_data*) req->data;
 
+  if (aData->object->mCommit == aData)
+    aData->object->mCommit = NULL;
+
   Handle<Value> argv[1];
   if (aData->error)
     argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
 
   tryCallCatch(aData->callback, aData->object->handle_, aData->error ? 1 : 0, argv);
+  for (size_t a = 0; a < aData->waiters.size(); ++a)
+    tryCallCatch(aData->waiters[a].callback, aData->waiters[a].context, aData->error ? 1 : 0, argv);
+
+  for (size_t a = 0; a < aData->replicas.size(); ++a) {
+    aData->replicas[a]->mBusy = false;
+    Handle<Value> aArgv[2];
+    if (aData->error) {
+      aArgv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
+    } else if (!aData->replicaerror[a].empty()) {
+      aArgv[0] = Exception::Error(String::New(aData->replicaerror[a].c_str()));
+    } else {
+      aArgv[0] = Null();
+      aArgv[1] = replicationInfo(aData->replicainfo[a]);
+    }
+    aData->replicas[a]->Emit(String::New("applied"), aArgv[0]->IsNull() ? 2 : 1, aArgv);
+    aData->replicas[a]->Unref();
+  }
+
+  delete aData;
+
+  return 0;
+}
+
+/*
+Replication, after Xapian's DatabaseMaster and DatabaseReplica:
+  set_max_changesets(n) before opening a WritableDatabase, so its commits keep changesets
+  replica.get_revision_info() // string for the master
+  wdb.write_changesets_to_fd(fd, revision, function(err, info))
+  replica.apply_changesets(fd, [reader_close_time,] function(err, info)), then reopen()
+    any Database opened on the replica path
+  info is { changeset_count: number, fullcopy_count: number, changed: boolean }
+fd may be either end of a pipe, or a file written by the master and read by the replica
+set_max_changesets() must be called before the first async op, as pool threads read it
+
+Publishing, for replicas in this process:
+  wdb.add_replica(replica) // after each commit() or commit_transaction(), the commit's
+    pool job writes changesets to a temporary file and applies them to the replica
+  replica emits 'applied' with (err, info); then reopen() Databases on its path
+  a replica busy at commit time is skipped, and catches up at the next commit
+*/
+
+Handle<Value> WritableDatabase::SetMaxChangesets(const Arguments& args) {
+  HandleScope scope;
+  if (args.Length() < 1 || !args[0]->IsUint32())
+    return ThrowException(Exception::TypeError(String::New("arguments are (number)")));
+  // Xapian reads this via getenv() when a pool thread opens a WritableDatabase
+  if (sExecutor.started)
+    return ThrowException(Exception::Error(String::New("set_max_changesets must be called before the first async op")));
+  setenv("XAPIAN_MAX_CHANGESETS", *String::Utf8Value(args[0]->ToString()), 1);
+  return Undefined();
+}
+
+
+Handle<Value> WritableDatabase::WriteChangesets(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() < 3 || !args[0]->IsInt32() || !args[1]->IsString() || !args[2]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (number, string, function)")));
+  WritableDatabase* that = ObjectWrap::Unwrap<WritableDatabase>(args.This());
+  if (that->mPaths.empty())
+    return ThrowException(Exception::Error(String::New("database not open")));
+  WriteChangesets_data* aData;
+  try {
+    aData = new WriteChangesets_data(args.This(), Local<Function>::Cast(args[2]), args[0]->Int32Value(), args[1]->ToString(), that->mPaths[0]);
+  } catch (Local<Value> ex) {
+    return ThrowException(ex);
+  }
+
+  sExecutor.submit(WriteChangesets_pool, WriteChangesets_done, aData);
+
+  return Undefined();
+}
+
+Handle<Value> WritableDatabase::AddReplica(const Arguments& args) {
+  HandleScope scope;
+  DatabaseReplica* aReplica;
+  if (args.Length() < 1 || !(aReplica = GetInstance<DatabaseReplica>(args[0])))
+    return ThrowException(Exception::TypeError(String::New("arguments are (DatabaseReplica)")));
+  WritableDatabase* that = ObjectWrap::Unwrap<WritableDatabase>(args.This());
+  for (size_t a = 0; a < that->mReplicas.size(); ++a)
+    if (ObjectWrap::Unwrap<DatabaseReplica>(that->mReplicas[a]) == aReplica)
+      return Undefined();
+  that->mReplicas.push_back(Persistent<Object>::New(args[0]->ToObject()));
+  return Undefined();
+}
+
+// main thread; replicas not open or busy with another op are left for the next commit
+void WritableDatabase::holdReplicas(Commit_data* data) {
+  if (mPaths.empty())
+    return;
+  data->path = mPaths[0];
+  for (size_t a = 0; a < mReplicas.size(); ++a) {
+    DatabaseReplica* aReplica = ObjectWrap::Unwrap<DatabaseReplica>(mReplicas[a]);
+    if (aReplica->mBusy || !aReplica->mReplica)
+      continue;
+    aReplica->mBusy = true;
+    aReplica->Ref();
+    data->replicas.push_back(aReplica);
+  }
+  data->replicainfo.resize(data->replicas.size());
+  data->replicaerror.resize(data->replicas.size());
+}
+
+// pool thread, after the commit; Commit_done releases the replicas
+void WritableDatabase::publishChangesets(Commit_data* data) {
+  for (size_t a = 0; a < data->replicas.size(); ++a) {
+    FILE* aTmp = NULL;
+    if (data->error) {
+    } else if (!(aTmp = tmpfile())) {
+      data->replicaerror[a] = "tmpfile() failed";
+    } else {
+      Xapian::DatabaseReplica* aReplica = data->replicas[a]->mReplica;
+      try {
+        Xapian::DatabaseMaster aMaster(data->path);
+        aMaster.write_changesets_to_fd(fileno(aTmp), aReplica->get_revision_info(), NULL);
+        lseek(fileno(aTmp), 0, SEEK_SET);
+        aReplica->set_read_fd(fileno(aTmp));
+        Xapian::ReplicationInfo aStep;
+        Xapian::ReplicationInfo& aInfo = data->replicainfo[a];
+        bool aMore;
+        do {
+          aStep.clear();
+          aMore = aReplica->apply_next_changeset(&aStep, 0.0);
+          aInfo.changeset_count += aStep.changeset_count;
+          aInfo.fullcopy_count += aStep.fullcopy_count;
+          aInfo.changed = aInfo.changed || aStep.changed;
+        } while (aMore);
+      } catch (const Xapian::Error& err) {
+        data->replicaerror[a] = err.get_msg();
+      }
+      fclose(aTmp);
+    }
+  }
+}
+
+int WritableDatabase::WriteChangesets_pool(eio_req *req) {
+  WriteChangesets_data* aData = (WriteChangesets_data*) req->data;
+
+  try {
+    Xapian::DatabaseMaster aMaster(aData->path);
+    aMaster.write_changesets_to_fd(aData->fd, std::string(*aData->revision, aData->revision.length()), &aData->info);
+  } catch (const Xapian::Error& err) {
+    aData->error = new Xapian::Error(err);
+  }
+
+  aData->poolDone();
+  return 0;
+}
+
+int WritableDatabase::WriteChangesets_done(eio_req *req) {
+  HandleScope scope;
+
+  WriteChangesets_data* aData = (WriteChangesets_data*) req->data;
+
+  Handle<Value> argv[2];
+  if (aData->error) {
+    argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
+  } else {
+    argv[0] = Null();
+    argv[1] = replicationInfo(aData->info);
+  }
+
+  tryCallCatch(aData->callback, aData->object->handle_, aData->error ? 1 : 2, argv);
+
+  delete aData;
+
+  return 0;
+}
+
+Persistent<FunctionTemplate> DatabaseReplica::constructor_template;
+
+void DatabaseReplica::Init(Handle<Object> target) {
+  constructor_template = Persistent<FunctionTemplate>::New(FunctionTemplate::New(New));
+  constructor_template->Inherit(EventEmitter::constructor_template);
+  constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+  constructor_template->SetClassName(String::NewSymbol("DatabaseReplica"));
+
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "get_revision_info", GetRevisionInfo);
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "apply_changesets", ApplyChangesets);
+
+  target->Set(String::NewSymbol("DatabaseReplica"), constructor_template->GetFunction());
+}
+
+Handle<Value> DatabaseReplica::New(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() < 1 || !args[0]->IsString())
+    return ThrowException(Exception::TypeError(String::New("arguments are (string)")));
+
+  DatabaseReplica* that = new DatabaseReplica();
+  that->Wrap(args.This());
+
+  sExecutor.submit(Open_pool, Open_done, new Open_data(args.This(), args[0]->ToString()));
+
+  return args.This();
+}
+
+int DatabaseReplica::Open_pool(eio_req *req) {
+  Open_data* aData = (Open_data*) req->data;
+
+  try {
+    aData->object->mReplica = new Xapian::DatabaseReplica(*aData->filename);
+  } catch (const Xapian::Error& err) {
+    aData->error = new Xapian::Error(err);
+  }
+
+  aData->poolDone();
+  return 0;
+}
+
+int DatabaseReplica::Open_done(eio_req *req) {
+  HandleScope scope;
+
+  Open_data* aData = (Open_data*) req->data;
+
+  Handle<Value> argv[1];
+  if (aData->error)
+    argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
+
+  aData->object->Emit(String::New("open"), aData->error ? 1 : 0, argv);
+
+  delete aData;
+
+  return 0;
+}
+
+Handle<Value> DatabaseReplica::GetRevisionInfo(const Arguments& args) {
+  HandleScope scope;
+  DatabaseReplica* that = ObjectWrap::Unwrap<DatabaseReplica>(args.This());
+  if (that->mBusy)
+    return ThrowException(Exception::Error(kBusyMsg));
+  if (!that->mReplica)
+    return ThrowException(Exception::Error(String::New("replica not open")));
+  std::string aRev;
+  try {
+    aRev = that->mReplica->get_revision_info();
+  } catch (const Xapian::Error& err) {
+    return ThrowException(Exception::Error(String::New(err.get_msg().c_str())));
+  }
+  return scope.Close(String::New(aRev.data(), aRev.size()));
+}
+
+Handle<Value> DatabaseReplica::ApplyChangesets(const Arguments& args) {
+  HandleScope scope;
+
+  int aCb = args.Length() > 2 ? 2 : 1;
+  if (args.Length() < 2 || !args[0]->IsInt32() || (aCb == 2 && !args[1]->IsNumber()) || !args[aCb]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (number, [number,] function)")));
+  if (!ObjectWrap::Unwrap<DatabaseReplica>(args.This())->mReplica)
+    return ThrowException(Exception::Error(String::New("replica not open")));
+  ApplyChangesets_data* aData;
+  try {
+    aData = new ApplyChangesets_data(args.This(), Local<Function>::Cast(args[aCb]), args[0]->Int32Value(), aCb == 2 ? args[1]->NumberValue() : 0.0);
+  } catch (Local<Value> ex) {
+    return ThrowException(ex);
+  }
+
+  sExecutor.submit(ApplyChangesets_pool, ApplyChangesets_done, aData);
+
+  return Undefined();
+}
+
+int DatabaseReplica::ApplyChangesets_pool(eio_req *req) {
+  ApplyChangesets_data* aData = (ApplyChangesets_data*) req->data;
+
+  try {
+    aData->object->mReplica->set_read_fd(aData->fd);
+    Xapian::ReplicationInfo aStep;
+    bool aMore;
+    do {
+      aStep.clear();
+      aMore = aData->object->mReplica->apply_next_changeset(&aStep, aData->closetime);
+      aData->info.changeset_count += aStep.changeset_count;
+      aData->info.fullcopy_count += aStep.fullcopy_count;
+      aData->info.changed = aData->info.changed || aStep.changed;
+    } while (aMore);
+  } catch (const Xapian::Error& err) {
+    aData->error = new Xapian::Error(err);
+  }
+
+  aData->poolDone();
+  return 0;
+}
+
+int DatabaseReplica::ApplyChangesets_done(eio_req *req) {
+  HandleScope scope;
+
+  ApplyChangesets_data* aData = (ApplyChangesets_data*) req->data;
+
+  Handle<Value> argv[2];
+  if (aData->error) {
+    argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
+  } else {
+    argv[0] = Null();
+    argv[1] = replicationInfo(aData->info);
+  }
+
+  tryCallCatch(aData->callback, aData->object->handle_, aData->error ? 1 : 2, argv);
 
   delete aData;
 
@@ -646,6 +2834,8 @@ Handle<Value> TermGenerator::SetDatabase(const Arguments& args) {
     return ThrowException(Exception::TypeError(String::New("arguments are (Database)")));
 
   TermGenerator* that = ObjectWrap::Unwrap<TermGenerator>(args.This());
+  if (that->mBusy)
+    return ThrowException(Exception::Error(kBusyMsg));
   try {
     that->mTg.set_database(aDb->getWdb());
   } catch (const Xapian::Error& err) {
@@ -661,6 +2851,8 @@ Handle<Value> TermGenerator::SetFlags(const Arguments& args) {
     return ThrowException(Exception::TypeError(String::New("arguments are (integer)")));
 
   TermGenerator* that = ObjectWrap::Unwrap<TermGenerator>(args.This());
+  if (that->mBusy)
+    return ThrowException(Exception::Error(kBusyMsg));
   try {
     that->mTg.set_flags((Xapian::TermGenerator::flags)args[0]->Int32Value());
   } catch (const Xapian::Error& err) {
@@ -677,6 +2869,8 @@ Handle<Value> TermGenerator::SetStemmer(const Arguments& args) {
     return ThrowException(Exception::TypeError(String::New("arguments are (Stem)")));
 
   TermGenerator* that = ObjectWrap::Unwrap<TermGenerator>(args.This());
+  if (that->mBusy)
+    return ThrowException(Exception::Error(kBusyMsg));
   try {
     that->mTg.set_stemmer(aSt->mStem);
   } catch (const Xapian::Error& err) {
@@ -712,7 +2906,103 @@ Handle<Value> Stem::New(const Arguments& args) {
   return args.This();
 }
 
+Persistent<FunctionTemplate> Weight::constructor_template;
+
+void Weight::Init(Handle<Object> target) {
+  constructor_template = Persistent<FunctionTemplate>::New(FunctionTemplate::New(New));
+  constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+  constructor_template->SetClassName(String::NewSymbol("Weight"));
+
+  target->Set(String::NewSymbol("Weight"), constructor_template->GetFunction());
+}
+
+Handle<Value> Weight::New(const Arguments& args) {
+  return ThrowException(Exception::TypeError(String::New("Weight is abstract; use BoolWeight, BM25Weight or TradWeight")));
+}
+
+Persistent<FunctionTemplate> BoolWeight::constructor_template;
+
+void BoolWeight::Init(Handle<Object> target) {
+  constructor_template = Persistent<FunctionTemplate>::New(FunctionTemplate::New(New));
+  constructor_template->Inherit(Weight::constructor_template);
+  constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+  constructor_template->SetClassName(String::NewSymbol("BoolWeight"));
+
+  target->Set(String::NewSymbol("BoolWeight"), constructor_template->GetFunction());
+}
+
+Handle<Value> BoolWeight::New(const Arguments& args) {
+  HandleScope scope;
+  BoolWeight* that = new BoolWeight;
+  that->Wrap(args.This());
+  return args.This();
+}
+
+Persistent<FunctionTemplate> BM25Weight::constructor_template;
+
+void BM25Weight::Init(Handle<Object> target) {
+  constructor_template = Persistent<FunctionTemplate>::New(FunctionTemplate::New(New));
+  constructor_template->Inherit(Weight::constructor_template);
+  constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+  constructor_template->SetClassName(String::NewSymbol("BM25Weight"));
+
+  target->Set(String::NewSymbol("BM25Weight"), constructor_template->GetFunction());
+}
+
+// no arguments for Xapian's defaults (1, 0, 1, 0.5, 0.5)
+Handle<Value> BM25Weight::New(const Arguments& args) {
+  HandleScope scope;
+  bool aOk = args.Length() == 0 || args.Length() == 5;
+  for (int a = 0; aOk && a < args.Length(); ++a)
+    aOk = args[a]->IsNumber();
+  if (!aOk)
+    return ThrowException(Exception::TypeError(String::New("arguments are ([k1, k2, k3, b, min_normlen])")));
+  double aP[] = { 1, 0, 1, 0.5, 0.5 };
+  for (int a = 0; a < args.Length(); ++a)
+    aP[a] = args[a]->NumberValue();
+  char aKey[160];
+  snprintf(aKey, sizeof(aKey), "bm25 %.17g %.17g %.17g %.17g %.17g", aP[0], aP[1], aP[2], aP[3], aP[4]);
+  BM25Weight* that;
+  try {
+    that = new BM25Weight(aP, aKey);
+  } catch (const Xapian::Error& err) {
+    return ThrowException(Exception::Error(String::New(err.get_msg().c_str())));
+  }
+  that->Wrap(args.This());
+  return args.This();
+}
+
+Persistent<FunctionTemplate> TradWeight::constructor_template;
+
+void TradWeight::Init(Handle<Object> target) {
+  constructor_template = Persistent<FunctionTemplate>::New(FunctionTemplate::New(New));
+  constructor_template->Inherit(Weight::constructor_template);
+  constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+  constructor_template->SetClassName(String::NewSymbol("TradWeight"));
+
+  target->Set(String::NewSymbol("TradWeight"), constructor_template->GetFunction());
+}
+
+Handle<Value> TradWeight::New(const Arguments& args) {
+  HandleScope scope;
+  if (args.Length() > 0 && !args[0]->IsNumber())
+    return ThrowException(Exception::TypeError(String::New("arguments are ([number])")));
+  double aK = args.Length() > 0 ? args[0]->NumberValue() : 1.0;
+  char aKey[40];
+  snprintf(aKey, sizeof(aKey), "trad %.17g", aK);
+  TradWeight* that;
+  try {
+    that = new TradWeight(aK, aKey);
+  } catch (const Xapian::Error& err) {
+    return ThrowException(Exception::Error(String::New(err.get_msg().c_str())));
+  }
+  that->Wrap(args.This());
+  return args.This();
+}
+
 Persistent<FunctionTemplate> Enquire::constructor_template;
+RecyclePool<Enquire::GetMset_data::Scratch> Enquire::GetMset_data::sScratch(16);
+std::map<std::string, Enquire::GetMset_data*> Enquire::sInFlight;
 
 void Enquire::Init(Handle<Object> target) {
   constructor_template = Persistent<FunctionTemplate>::New(FunctionTemplate::New(New));
@@ -720,7 +3010,10 @@ void Enquire::Init(Handle<Object> target) {
   constructor_template->SetClassName(String::NewSymbol("Enquire"));
 
   NODE_SET_PROTOTYPE_METHOD(constructor_template, "set_query", SetQuery);
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "set_collapse_key", SetCollapseKey);
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "set_weighting_scheme", SetWeightingScheme);
   NODE_SET_PROTOTYPE_METHOD(constructor_template, "get_mset", GetMset);
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "similar", Similar);
 
   target->Set(String::NewSymbol("Enquire"), constructor_template->GetFunction());
 }
@@ -730,7 +3023,7 @@ Handle<Value> Enquire::New(const Arguments& args) {
   Database* aDb;
   if (args.Length() < 1 || !(aDb = GetInstance<Database>(args[0])))
     return ThrowException(Exception::TypeError(String::New("arguments are (Database)")));
-  Enquire* that = new Enquire(aDb->getDb());
+  Enquire* that = new Enquire(aDb, args[0]->ToObject(), !GetInstance<WritableDatabase>(args[0]));
   that->Wrap(args.This());
   return args.This();
 }
@@ -751,41 +3044,537 @@ Handle<Value> Enquire::SetQuery(const Arguments& args) {
   return Undefined();
 }
 
+Handle<Value> Enquire::SetCollapseKey(const Arguments& args) {
+  HandleScope scope;
+  if (args.Length() < 1 || !(args[0]->IsUint32() || args[0]->IsNull()) || (args.Length() > 1 && !args[1]->IsUint32()))
+    return ThrowException(Exception::TypeError(String::New("arguments are (number|null, [number])")));
+  Enquire* that = ObjectWrap::Unwrap<Enquire>(args.This());
+  if (that->mBusy)
+    return ThrowException(Exception::Error(kBusyMsg));
+  try {
+    that->mEnq.set_collapse_key(args[0]->IsNull() ? Xapian::BAD_VALUENO : args[0]->Uint32Value(), args.Length() > 1 ? args[1]->Uint32Value() : 1);
+    char aCollapse[32];
+    snprintf(aCollapse, sizeof(aCollapse), "%u,%u", args[0]->Uint32Value(), args.Length() > 1 ? args[1]->Uint32Value() : 1);
+    that->mCollapse = args[0]->IsNull() ? "-" : aCollapse;
+  } catch (const Xapian::Error& err) {
+    return ThrowException(Exception::Error(String::New(err.get_msg().c_str())));
+  }
+  return Undefined();
+}
+
+// BoolWeight gives every match weight 0, so a pure filter skips scoring
+// and the matcher can stop as soon as it has enough documents
+Handle<Value> Enquire::SetWeightingScheme(const Arguments& args) {
+  HandleScope scope;
+  Weight* aW;
+  if (args.Length() < 1 || !(aW = GetInstance<Weight>(args[0])))
+    return ThrowException(Exception::TypeError(String::New("arguments are (Weight)")));
+  Enquire* that = ObjectWrap::Unwrap<Enquire>(args.This());
+  if (that->mBusy)
+    return ThrowException(Exception::Error(kBusyMsg));
+  try {
+    that->mEnq.set_weighting_scheme(*aW->mWeight);
+    that->mWeighting = aW->mKey;
+  } catch (const Xapian::Error& err) {
+    return ThrowException(Exception::Error(String::New(err.get_msg().c_str())));
+  }
+  return Undefined();
+}
+
+/*
+get_mset options object: {
+  // all members optional
+  check_at_least: number, // minimum documents to examine, for more accurate facet counts and estimates
+  percent_cutoff: number, // pass to Enquire::set_cutoff() for this call
+  weight_cutoff: number, // ditto
+  time_limit: number, // seconds after which the match ends early, via Enquire::set_time_limit(); needs Xapian 1.4,
+    // else get_mset() throws
+  snippet: { length: number, hi_start: string, hi_end: string, omit: string, stem: Stem } // excerpt of document data
+    // highlighting query terms; all members optional, defaults 200, '<b>', '</b>', '...', no stemming
+  facets: { slot: maxvalues, ... }, // count values in slot across matches; maxvalues 0 for all, else most frequent;
+    // info.facets is { slot: { total: number, values: [ { value: Buffer, count: number }, ... ] }, ... }
+  cancellable: boolean, // let OpHandle::cancel() make a running match reject its remaining candidates, at some
+    // cost per candidate; otherwise it only removes a queued op, and a running one completes without calling back
+  prefetch: boolean, // load each hit's data and cached values into the document cache; see set_document_cache()
+  batch_size: number, // call function once per batch of this many hits, with info.more true until the last;
+    // batches are spread over event loop iterations
+  tick_budget: number // milliseconds of batch delivery per loop iteration, default 5; shared by all results
+    // being delivered in parts, which get the smallest of their budgets; coalesced calls keep the smallest of theirs
+}
+*/
+
 Handle<Value> Enquire::GetMset(const Arguments& args) {
   HandleScope scope;
 
-  if (args.Length() < 3 || !args[0]->IsUint32() || !args[1]->IsUint32() || !args[2]->IsFunction())
-    return ThrowException(Exception::TypeError(String::New("arguments are (number, number, function)")));
+  int aCb = args.Length() > 3 ? 3 : 2;
+  if (args.Length() < 3 || !args[0]->IsUint32() || !args[1]->IsUint32() || (aCb == 3 && !args[2]->IsObject()) || !args[aCb]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (number, number, [object,] function)")));
+  GetMset_data::Options aOpts;
+  if (aCb == 3) {
+    Handle<Value> aErr = GetMset_options(args[2]->ToObject(), aOpts);
+    if (!aErr.IsEmpty())
+      return ThrowException(aErr);
+  }
+  return scope.Close(GetMset_start(args.This(), args[0]->Uint32Value(), args[1]->Uint32Value(), aOpts, Local<Function>::Cast(args[aCb])));
+}
+
+/*
+similar(docids, [options,] function)
+  finds documents like those in docids, which are excluded from the results; the top
+  expansion terms of docids as a relevance set form an OP_ELITE_SET query, which is
+  matched in place of the query from set_query()
+  options: get_mset options, and {
+    first: number, max: number, // passed to get_mset(), default 0, 10
+    terms: number, // expansion terms to take, default 40
+    elite: number // of those, the most to match on, default 20
+  }
+  function(err, Array, info) as for get_mset, with info.terms the query terms
+*/
+
+Handle<Value> Enquire::Similar(const Arguments& args) {
+  HandleScope scope;
+
+  int aCb = args.Length() > 2 ? 2 : 1;
+  if (args.Length() < 2 || !args[0]->IsArray() || (aCb == 2 && !args[1]->IsObject()) || !args[aCb]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (array, [object,] function)")));
+  GetMset_data::Options aOpts;
+  Local<Array> aIds = Local<Array>::Cast(args[0]);
+  for (uint32_t a = 0; a < aIds->Length(); ++a) {
+    if (!aIds->Get(a)->IsUint32() || aIds->Get(a)->Uint32Value() == 0)
+      return ThrowException(Exception::TypeError(String::New("docids list member not a docid")));
+    aOpts.similar.push_back(aIds->Get(a)->Uint32Value());
+  }
+  if (aOpts.similar.empty())
+    return ThrowException(Exception::TypeError(String::New("docids list is empty")));
+  uint32_t aFirst = 0, aMax = 10;
+  if (aCb == 2) {
+    Local<Object> aObj = args[1]->ToObject();
+    Handle<Value> aErr = GetMset_options(aObj, aOpts);
+    if (!aErr.IsEmpty())
+      return ThrowException(aErr);
+    const char* aName[] = { "first", "max", "terms", "elite" };
+    uint32_t* aOpt[] = { &aFirst, &aMax, &aOpts.expandterms, &aOpts.eliteterms };
+    Local<String> aKey;
+    for (int a = 0; a < 4; ++a) {
+      if (aObj->Has(aKey = String::New(aName[a]))) {
+        Local<Value> aVal = aObj->Get(aKey);
+        if (!aVal->IsUint32())
+          return ThrowException(Exception::TypeError(String::Concat(String::New("options object member not a number: "), aKey)));
+        *aOpt[a] = aVal->Uint32Value();
+      }
+    }
+  }
+  return scope.Close(GetMset_start(args.This(), aFirst, aMax, aOpts, Local<Function>::Cast(args[aCb])));
+}
+
+// joins an identical op in flight, else queues a new one
+Handle<Value> Enquire::GetMset_start(Handle<Object> obj, uint32_t first, uint32_t max, const GetMset_data::Options& opts, Handle<Function> cb) {
+  HandleScope scope;
+  Enquire* that = ObjectWrap::Unwrap<Enquire>(obj);
+  std::string aKey;
+  if (that->mCoalesce) {
+    try {
+      aKey = GetMset_key(that, first, max, opts);
+    } catch (const Xapian::Error& err) {
+      return ThrowException(Exception::Error(String::New(err.get_msg().c_str())));
+    }
+    std::map<std::string, GetMset_data*>::iterator aIt = sInFlight.find(aKey);
+    if (aIt != sInFlight.end()) {
+      aIt->second->addWaiter(cb, obj);
+      aIt->second->budget = std::min(aIt->second->budget, opts.tickbudget); // not in the key
+      return scope.Close(OpHandle::NewInstance(aIt->second, aIt->second->waiters.size()));
+    }
+  }
   GetMset_data* aData;
   try {
-    aData = new GetMset_data(args.This(), Local<Function>::Cast(args[2]), args[0]->Uint32Value(), args[1]->Uint32Value());
+    aData = new GetMset_data(obj, cb, first, max, opts);
   } catch (Local<Value> ex) {
     return ThrowException(ex);
   }
+  if (!aKey.empty()) {
+    aData->key = aKey;
+    sInFlight[aKey] = aData;
+  }
+  if (that->mCoalesce && sDocCache.enabled())
+    aData->revision = that->mDatabase->getRevisionKey();
 
-  eio_custom(GetMset_pool, EIO_PRI_DEFAULT, GetMset_done, aData);
+  sExecutor.submit(GetMset_pool, GetMset_done, aData);
 
-  return Undefined();
+  return scope.Close(OpHandle::NewInstance(aData));
+}
+
+// identical get_mset calls in flight at once share one match; the key covers every
+// option, as each can change the result or how it is delivered, except tick_budget,
+// of which a shared op takes the smallest
+std::string Enquire::GetMset_key(Enquire* enq, uint32_t first, uint32_t max, const GetMset_data::Options& opts) {
+  char aNum[160];
+  snprintf(aNum, sizeof(aNum), "%u %u %u %d %.17g %.17g %d %u %d %d %u ", first, max, opts.checkatleast, opts.percentcutoff,
+           opts.weightcutoff, opts.timelimit, opts.snippet, (unsigned) opts.snippetlength, opts.prefetch, opts.cancellable,
+           (unsigned) opts.batchsize);
+  std::string aKey(enq->mDatabase->getRevisionKey());
+  aKey += ' ';
+  aKey += enq->mCollapse;
+  aKey += ' ';
+  aKey += enq->mWeighting;
+  aKey += ' ';
+  aKey += aNum;
+  const std::string* aStr[] = { &opts.histart, &opts.hiend, &opts.omit, &opts.stemlang };
+  for (int a = 0; a < 4; ++a) {
+    snprintf(aNum, sizeof(aNum), "%u:", (unsigned) aStr[a]->size());
+    aKey += aNum;
+    aKey += *aStr[a];
+  }
+  for (std::map<Xapian::valueno, size_t>::const_iterator a = opts.facets.begin(); a != opts.facets.end(); ++a) {
+    snprintf(aNum, sizeof(aNum), "f%u=%u", a->first, (unsigned) a->second);
+    aKey += aNum;
+  }
+  aKey += ' ';
+  if (!opts.similar.empty()) {
+    snprintf(aNum, sizeof(aNum), "s%u,%u:", opts.expandterms, opts.eliteterms);
+    aKey += aNum;
+    for (size_t a = 0; a < opts.similar.size(); ++a) {
+      snprintf(aNum, sizeof(aNum), "%u,", opts.similar[a]);
+      aKey += aNum;
+    }
+    return aKey;
+  }
+  aKey += enq->mEnq.get_query().get_description();
+  return aKey;
+}
+
+Handle<Value> Enquire::GetMset_options(Handle<Object> obj, GetMset_data::Options& opts) {
+  Local<String> aKey;
+  Local<Value> aVal;
+  if (obj->Has(aKey = String::New("check_at_least"))) {
+    aVal = obj->Get(aKey);
+    if (!aVal->IsUint32())
+      return Exception::TypeError(String::New("options object check_at_least not a number"));
+    opts.checkatleast = aVal->Uint32Value();
+  }
+  if (obj->Has(aKey = String::New("percent_cutoff"))) {
+    aVal = obj->Get(aKey);
+    if (!aVal->IsUint32() || aVal->Uint32Value() > 100)
+      return Exception::TypeError(String::New("options object percent_cutoff not a number 0-100"));
+    opts.percentcutoff = aVal->Uint32Value();
+  }
+  if (obj->Has(aKey = String::New("weight_cutoff"))) {
+    aVal = obj->Get(aKey);
+    if (!aVal->IsNumber() || aVal->NumberValue() < 0)
+      return Exception::TypeError(String::New("options object weight_cutoff not a positive number"));
+    opts.weightcutoff = aVal->NumberValue();
+  }
+  if (obj->Has(aKey = String::New("time_limit"))) {
+    aVal = obj->Get(aKey);
+    if (!aVal->IsNumber() || aVal->NumberValue() < 0)
+      return Exception::TypeError(String::New("options object time_limit not a positive number"));
+#if HAVE_TIME_LIMIT
+    opts.timelimit = aVal->NumberValue();
+#else
+    return Exception::Error(String::New("options object time_limit requires Xapian 1.4"));
+#endif
+  }
+  if (obj->Has(aKey = String::New("snippet"))) {
+    aVal = obj->Get(aKey);
+    if (!aVal->IsObject())
+      return Exception::TypeError(String::New("options object snippet not an object"));
+    Local<Object> aSnip = aVal->ToObject();
+    opts.snippet = true;
+    if (aSnip->Has(aKey = String::New("length"))) {
+      aVal = aSnip->Get(aKey);
+      if (!aVal->IsUint32())
+        return Exception::TypeError(String::New("options object snippet.length not a number"));
+      opts.snippetlength = aVal->Uint32Value();
+    }
+    const char* aMarkup[] = { "hi_start", "hi_end", "omit" };
+    std::string* aMarkupOpt[] = { &opts.histart, &opts.hiend, &opts.omit };
+    for (int a = 0; a < 3; ++a) {
+      if (aSnip->Has(aKey = String::New(aMarkup[a]))) {
+        aVal = aSnip->Get(aKey);
+        if (!aVal->IsString())
+          return Exception::TypeError(String::Concat(String::New("options object snippet member not a string: "), aKey));
+        *aMarkupOpt[a] = *String::Utf8Value(aVal);
+      }
+    }
+    if (aSnip->Has(aKey = String::New("stem"))) {
+      Stem* aSt = GetInstance<Stem>(aSnip->Get(aKey));
+      if (!aSt)
+        return Exception::TypeError(String::New("options object snippet.stem not a Stem"));
+      opts.stemlang = aSt->mLang;
+    }
+  }
+  if (obj->Has(aKey = String::New("cancellable"))) {
+    aVal = obj->Get(aKey);
+    if (!aVal->IsBoolean())
+      return Exception::TypeError(String::New("options object cancellable not a boolean"));
+    opts.cancellable = aVal->IsTrue();
+  }
+  if (obj->Has(aKey = String::New("batch_size"))) {
+    aVal = obj->Get(aKey);
+    if (!aVal->IsUint32())
+      return Exception::TypeError(String::New("options object batch_size not a number"));
+    opts.batchsize = aVal->Uint32Value();
+  }
+  if (obj->Has(aKey = String::New("tick_budget"))) {
+    aVal = obj->Get(aKey);
+    if (!aVal->IsNumber() || aVal->NumberValue() < 0)
+      return Exception::TypeError(String::New("options object tick_budget not a positive number"));
+    opts.tickbudget = aVal->NumberValue() / 1000;
+  }
+  if (obj->Has(aKey = String::New("prefetch"))) {
+    aVal = obj->Get(aKey);
+    if (!aVal->IsBoolean())
+      return Exception::TypeError(String::New("options object prefetch not a boolean"));
+    opts.prefetch = aVal->IsTrue();
+  }
+  if (obj->Has(aKey = String::New("facets"))) {
+    aVal = obj->Get(aKey);
+    if (!aVal->IsObject())
+      return Exception::TypeError(String::New("options object facets not an object"));
+    Local<Object> aFacets = aVal->ToObject();
+    Local<Array> aNames = aFacets->GetPropertyNames();
+    for (uint32_t a = 0; a < aNames->Length(); ++a) {
+      aVal = aNames->Get(a);
+      if (!aVal->IsUint32())
+        return Exception::TypeError(String::New("options object facets key not a slot number"));
+      uint32_t aSlot = aVal->Uint32Value();
+      aVal = aFacets->Get(aSlot);
+      if (!aVal->IsUint32())
+        return Exception::TypeError(String::New("options object facets member not a number"));
+      opts.facets[aSlot] = aVal->Uint32Value();
+    }
+  }
+  return Handle<Value>();
+}
+
+static void appendEscaped(std::string& out, const char* p, size_t len) {
+  for (size_t a = 0; a < len; ++a) {
+    switch (p[a]) {
+    case '&': out += "&amp;"; break;
+    case '<': out += "&lt;";  break;
+    case '>': out += "&gt;";  break;
+    default:  out += p[a];
+    }
+  }
+}
+
+struct SnippetWord { size_t start, end; bool match; };
+
+// the largest offset <= pos that isn't inside a UTF-8 sequence
+static size_t utf8Floor(const std::string& text, size_t pos) {
+  if (pos >= text.size())
+    return text.size();
+  while (pos > 0 && (text[pos] & 0xC0) == 0x80)
+    --pos;
+  return pos;
+}
+
+// appends the text from pos up to word, then word up to end, between histart and
+// hiend if it matched; returns the offset after it
+static size_t appendSnippetWord(std::string& out, const std::string& text, size_t pos, const SnippetWord& word, size_t end,
+                                const std::string& histart, const std::string& hiend) {
+  appendEscaped(out, text.data() + pos, word.start - pos);
+  if (word.match)
+    out += histart;
+  appendEscaped(out, text.data() + word.start, end - word.start);
+  if (word.match)
+    out += hiend;
+  return end;
+}
+
+// like MSet::snippet() from later Xapian releases: picks the window of text
+// with the most query terms, escapes it as HTML, and marks up the terms
+std::string Enquire::GetMset_snippet(const std::string& text, const std::set<std::string>& terms, Xapian::Stem* stem, const GetMset_data::Options& opts) {
+  std::vector<SnippetWord> aWords;
+  std::string aLower;
+  for (Xapian::Utf8Iterator aIt(text), aEnd; aIt != aEnd; ) {
+    if (!Xapian::Unicode::is_wordchar(*aIt)) {
+      ++aIt;
+      continue;
+    }
+    SnippetWord aW;
+    aW.start = aIt.raw() - text.data();
+    aLower.clear();
+    for (; aIt != aEnd && Xapian::Unicode::is_wordchar(*aIt); ++aIt)
+      Xapian::Unicode::append_utf8(aLower, Xapian::Unicode::tolower(*aIt));
+    aW.end = aIt == aEnd ? text.size() : aIt.raw() - text.data();
+    aW.match = terms.count(aLower) > 0;
+    if (!aW.match && stem) {
+      std::string aStem((*stem)(aLower));
+      aW.match = terms.count(aStem) || terms.count("Z" + aStem);
+    }
+    aWords.push_back(aW);
+  }
+
+  bool aWhole = text.size() <= opts.snippetlength;
+  size_t aFirst = 0, aLast = aWords.size(); // window is aWords[aFirst, aLast)
+  if (!aWhole) {
+    size_t aBest = 0, aCount = 0, aJ = 0;
+    aLast = 0;
+    for (size_t aI = 0; aI < aWords.size(); ++aI) {
+      if (aJ <= aI) {
+        aJ = aI + 1; // window always holds word aI, even if it exceeds the length
+        aCount = aWords[aI].match;
+      }
+      for (; aJ < aWords.size() && aWords[aJ].end - aWords[aI].start <= opts.snippetlength; ++aJ)
+        aCount += aWords[aJ].match;
+      if (aLast == 0 || aCount > aBest) {
+        aBest = aCount;
+        aFirst = aI;
+        aLast = aJ;
+      }
+      aCount -= aWords[aI].match;
+    }
+  }
+
+  std::string aOut;
+  if (aWhole) {
+    size_t aPos = 0;
+    for (size_t a = 0; a < aWords.size(); ++a)
+      aPos = appendSnippetWord(aOut, text, aPos, aWords[a], aWords[a].end, opts.histart, opts.hiend);
+    appendEscaped(aOut, text.data() + aPos, text.size() - aPos);
+    return aOut;
+  }
+  if (aWords.empty()) { // nothing to rank, so a leading excerpt
+    appendEscaped(aOut, text.data(), utf8Floor(text, opts.snippetlength));
+    aOut += opts.omit;
+    return aOut;
+  }
+  // text before the first word is kept only if the window still fits with it;
+  // a single word longer than the window is cut at a character boundary
+  size_t aPos = aFirst || aWords[aLast-1].end > opts.snippetlength ? aWords[aFirst].start : 0;
+  size_t aLimit = utf8Floor(text, aPos + opts.snippetlength);
+  bool aCut = false;
+  if (aPos)
+    aOut += opts.omit;
+  for (size_t a = aFirst; a < aLast && aWords[a].start < aLimit; ++a) {
+    aCut = aWords[a].end > aLimit;
+    aPos = appendSnippetWord(aOut, text, aPos, aWords[a], aCut ? aLimit : aWords[a].end, opts.histart, opts.hiend);
+  }
+  if (aCut || aLast < aWords.size())
+    aOut += opts.omit;
+  return aOut;
 }
 
 int Enquire::GetMset_pool(eio_req *req) {
   GetMset_data* aData = (GetMset_data*) req->data;
+  bool aCutoff = aData->options.percentcutoff || aData->options.weightcutoff;
+  bool aSimilar = !aData->options.similar.empty();
+  Xapian::Query aQuery; // set_query()'s, while similar() replaces it
+  Xapian::RSet aRSet;
 
   try {
-  Xapian::MSet aSet = aData->object->mEnq.get_mset(aData->first, aData->maxitems);
-  aData->set = new GetMset_data::Item[aSet.size()];
-  aData->size = 0;
+  if (aSimilar) {
+    aQuery = aData->object->mEnq.get_query();
+    for (size_t a = 0; a < aData->options.similar.size(); ++a)
+      aRSet.add_document(aData->options.similar[a]);
+    PlainTermDecider aPlain;
+    // the flagless overload leaves out terms of the set_query() query, which a
+    // similar document usually shares
+    Xapian::ESet aESet = aData->object->mEnq.get_eset(aData->options.expandterms, aRSet, Xapian::Enquire::INCLUDE_QUERY_TERMS,
+                                                      1.0, &aPlain);
+    for (Xapian::ESetIterator a = aESet.begin(); a != aESet.end(); ++a)
+      aData->expanded.push_back(*a);
+    aData->object->mEnq.set_query(Xapian::Query(Xapian::Query::OP_ELITE_SET, aData->expanded.begin(), aData->expanded.end(), aData->options.eliteterms));
+  }
+  for (std::map<Xapian::valueno, size_t>::iterator a = aData->options.facets.begin(); a != aData->options.facets.end(); ++a) {
+    aData->spies.push_back(new Xapian::ValueCountMatchSpy(a->first));
+    aData->object->mEnq.add_matchspy(aData->spies.back());
+  }
+  if (aCutoff)
+    aData->object->mEnq.set_cutoff(aData->options.percentcutoff, aData->options.weightcutoff);
+#if HAVE_TIME_LIMIT
+  if (aData->options.timelimit)
+    aData->object->mEnq.set_time_limit(aData->options.timelimit);
+#endif
+  MatchCancel aDecider(&aData->cancelled, aSimilar ? &aRSet : NULL);
+  // a decider costs a virtual call per candidate, so only ops which need one get it
+  bool aUseDecider = aData->options.cancellable || aSimilar;
+  // with similar, the source documents also inform the weights, as relevance feedback
+  Xapian::MSet aSet = aData->object->mEnq.get_mset(aData->first, aData->maxitems, aData->options.checkatleast, aSimilar ? &aRSet : NULL,
+                                                   aUseDecider ? &aDecider : NULL);
+  if (aCutoff)
+    aData->object->mEnq.set_cutoff(0, 0);
+#if HAVE_TIME_LIMIT
+  if (aData->options.timelimit)
+    aData->object->mEnq.set_time_limit(0);
+#endif
+  aData->estimated = aSet.get_matches_estimated();
+  aData->lowerbound = aSet.get_matches_lower_bound();
+  aData->upperbound = aSet.get_matches_upper_bound();
+  if (aData->spies.size()) {
+    aData->object->mEnq.clear_matchspies();
+    aData->facetlist.resize(aData->spies.size());
+    int aF = 0;
+    for (std::map<Xapian::valueno, size_t>::iterator a = aData->options.facets.begin(); a != aData->options.facets.end(); ++a, ++aF) {
+      GetMset_data::Facet& aFacet = aData->facetlist[aF];
+      Xapian::ValueCountMatchSpy* aSpy = aData->spies[aF];
+      aFacet.slot = a->first;
+      aFacet.total = aSpy->get_total();
+      Xapian::TermIterator aEnd = a->second ? aSpy->top_values_end(a->second) : aSpy->values_end();
+      for (Xapian::TermIterator aV = a->second ? aSpy->top_values_begin(a->second) : aSpy->values_begin(); aV != aEnd; ++aV)
+        aFacet.counts.push_back(std::make_pair(*aV, aV.get_termfreq()));
+    }
+  }
+  // checked as the result grows, so an oversized one stops early rather than once built
+  size_t aBytes = sizeof(GetMset_data) + aSet.size() * (sizeof(GetMset_data::Item) + kDocumentBytes);
+  for (size_t a = 0; a < aData->facetlist.size(); ++a)
+    for (size_t aC = 0; aC < aData->facetlist[a].counts.size(); ++aC)
+      aBytes += sizeof(aData->facetlist[a].counts[aC]) + aData->facetlist[a].counts[aC].first.size();
+  checkOpMemory(aBytes, "get_mset result");
+  GetMset_data::Scratch* aScratch = aData->scratch;
+  if (aScratch->items.size() < aSet.size())
+    aScratch->items.resize(aSet.size());
+  aScratch->documents.reserve(aSet.size());
   for (Xapian::MSetIterator a = aSet.begin(); a != aSet.end(); ++a, ++aData->size) {
-    aData->set[aData->size].id = *a;
-    aData->set[aData->size].document = new Xapian::Document(a.get_document());
-    aData->set[aData->size].rank = a.get_rank();
-    aData->set[aData->size].collapse_count = a.get_collapse_count();
-    aData->set[aData->size].weight = a.get_weight();
-    aData->set[aData->size].collapse_key = a.get_collapse_key();
-    aData->set[aData->size].description = a.get_description();
-    aData->set[aData->size].percent = a.get_percent();
+    GetMset_data::Item& aItem = aScratch->items[aData->size];
+    aItem.id = *a;
+    aScratch->documents.push_back(a.get_document());
+    aItem.rank = a.get_rank();
+    aItem.collapse_count = a.get_collapse_count();
+    aItem.weight = a.get_weight();
+    aItem.collapse_key = a.get_collapse_key();
+    aItem.description = a.get_description();
+    aItem.percent = a.get_percent();
+    aBytes += aItem.collapse_key.size() + aItem.description.size();
+    checkOpMemory(aBytes, "get_mset result");
   }
+  if (aData->options.snippet && !aData->cancelled) {
+    std::set<std::string> aTerms(aData->object->mEnq.get_query().get_terms_begin(), aData->object->mEnq.get_query().get_terms_end());
+    Xapian::Stem* aStem = aData->options.stemlang.empty() ? NULL : new Xapian::Stem(aData->options.stemlang);
+    try {
+      for (int a = 0; a < aData->size; ++a) {
+        std::string aKey(aData->revision.empty() ? "" : DocCache::key(aData->revision, aScratch->items[a].id));
+        aScratch->items[a].snippet = GetMset_snippet(sDocCache.data(aKey, aScratch->documents[a]), aTerms, aStem, aData->options);
+        aBytes += aScratch->items[a].snippet.size();
+        checkOpMemory(aBytes, "get_mset result");
+      }
+    } catch (const Xapian::Error& err) {
+      delete aStem;
+      throw;
+    }
+    delete aStem;
+  }
+  if (aData->options.prefetch && !aData->revision.empty()) {
+    for (int a = 0; a < aData->size && !aData->cancelled; ++a) {
+      std::string aKey(DocCache::key(aData->revision, aScratch->items[a].id));
+      if (!sDocCache.has(aKey))
+        sDocCache.load(aKey, aScratch->documents[a]);
+    }
+  }
+  if (aSimilar)
+    aData->object->mEnq.set_query(aQuery);
+  aData->resultbytes = aBytes;
   } catch (const Xapian::Error& err) {
+    if (aData->spies.size())
+      aData->object->mEnq.clear_matchspies();
+    if (aCutoff)
+      aData->object->mEnq.set_cutoff(0, 0);
+#if HAVE_TIME_LIMIT
+    if (aData->options.timelimit)
+      aData->object->mEnq.set_time_limit(0);
+#endif
+    if (aSimilar)
+      aData->object->mEnq.set_query(aQuery);
     aData->error = new Xapian::Error(err);
   }
 
@@ -798,34 +3587,122 @@ int Enquire::GetMset_done(eio_req *req) {
 
   GetMset_data* aData = (GetMset_data*) req->data;
 
-  Handle<Value> argv[2];
+  aData->leaveInFlight();
+  if (!aData->error)
+    aData->holdMemory(eMemGetMset, aData->resultbytes);
+
+  if (!aData->error && aData->options.batchsize) {
+    aData->run();
+    return 0;
+  }
+  for (size_t aR = 0; aR <= aData->waiters.size(); ++aR)
+    if (!aData->isDropped(aR))
+      GetMset_deliver(aData, aR, 0, aData->size);
+
+  delete aData;
+
+  return 0;
+}
+
+bool Enquire::GetMset_data::slice() {
+  while (nextcaller <= waiters.size()) {
+    if (isDropped(nextcaller)) {
+      ++nextcaller;
+      nextitem = 0;
+      continue;
+    }
+    int aEnd = std::min(nextitem + (int) options.batchsize, size);
+    size_t aCaller = nextcaller;
+    int aBegin = nextitem;
+    if (aEnd < size) {
+      nextitem = aEnd;
+    } else {
+      ++nextcaller;
+      nextitem = 0;
+    }
+    GetMset_deliver(this, aCaller, aBegin, aEnd);
+    break;
+  }
+  return nextcaller > waiters.size();
+}
+
+// each caller gets its own Array and Document wrappers over the shared match, the
+// wrappers for a hit sharing one SharedDoc;
+// with batch_size, hits [begin, end) of them, with info.more set until the last
+// batch and facets and terms in the first only
+void Enquire::GetMset_deliver(GetMset_data* aData, size_t aR, int begin, int end) {
+  HandleScope scope;
+  Handle<Value> argv[3];
   if (aData->error) {
     argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
   } else {
     argv[0] = Null();
-    Local<Array> aList(Array::New(aData->size));
+    Local<Array> aList(Array::New(end - begin));
     Local<Function> aCtor(Document::constructor_template->GetFunction());
-    for (int a = 0; a < aData->size; ++a) {
+    for (int a = begin; a < end; ++a) {
       Local<Object> aO(Object::New());
-      Local<Value> aDoc[] = { External::New(aData->set[a].document) };
-      aO->Set(String::NewSymbol("document"      ), aCtor->NewInstance(1, aDoc));
-      aO->Set(String::NewSymbol("id"            ), Uint32::New(aData->set[a].id                  ));
-      aO->Set(String::NewSymbol("rank"          ), Uint32::New(aData->set[a].rank                ));
-      aO->Set(String::NewSymbol("collapse_count"), Uint32::New(aData->set[a].collapse_count      ));
-      aO->Set(String::NewSymbol("weight"        ), Number::New(aData->set[a].weight              ));
-      aO->Set(String::NewSymbol("collapse_key"  ), String::New(aData->set[a].collapse_key.c_str()));
-      aO->Set(String::NewSymbol("description"   ), String::New(aData->set[a].description.c_str() ));
-      aO->Set(String::NewSymbol("percent"       ),  Int32::New(aData->set[a].percent             ));
-      aList->Set(a, aO);
+      GetMset_data::Item& aItem = aData->scratch->items[a];
+      if (aData->shared.empty())
+        aData->shared.resize(aData->size, NULL);
+      if (!aData->shared[a]) {
+        aData->shared[a] = new SharedDoc(aData->scratch->documents[a]);
+        aData->shared[a]->owner = Persistent<Object>::New(aData->object->mDbObj);
+        aData->shared[a]->ref();
+        aData->scratch->documents[a] = Xapian::Document();
+      }
+      Local<Value> aDoc[] = { External::New(aData->shared[a]), Number::New(kDocumentBytes),
+                              String::New(aData->revision.empty() ? "" : DocCache::key(aData->revision, aItem.id).c_str()) };
+      aO->Set(String::NewSymbol("document"      ), aCtor->NewInstance(3, aDoc));
+      aO->Set(String::NewSymbol("id"            ), Uint32::New(aItem.id                  ));
+      aO->Set(String::NewSymbol("rank"          ), Uint32::New(aItem.rank                ));
+      aO->Set(String::NewSymbol("collapse_count"), Uint32::New(aItem.collapse_count      ));
+      aO->Set(String::NewSymbol("weight"        ), Number::New(aItem.weight              ));
+      aO->Set(String::NewSymbol("collapse_key"  ), newValueBuffer(aItem.collapse_key)); // a value, e.g. a binary md5
+      aO->Set(String::NewSymbol("description"   ), String::New(aItem.description.c_str() ));
+      aO->Set(String::NewSymbol("percent"       ),  Int32::New(aItem.percent             ));
+      if (aData->options.snippet)
+        aO->Set(String::NewSymbol("snippet"     ), String::New(aItem.snippet.data(), aItem.snippet.size()));
+      aList->Set(a - begin, aO);
     }
     argv[1] = aList;
+    Local<Object> aInfo(Object::New());
+    aInfo->Set(String::NewSymbol("matches_estimated"  ), Uint32::New(aData->estimated ));
+    aInfo->Set(String::NewSymbol("matches_lower_bound"), Uint32::New(aData->lowerbound));
+    aInfo->Set(String::NewSymbol("matches_upper_bound"), Uint32::New(aData->upperbound));
+    aInfo->Set(String::NewSymbol("exact"), Boolean::New(aData->lowerbound == aData->upperbound));
+    if (aData->options.batchsize)
+      aInfo->Set(String::NewSymbol("more"), Boolean::New(end < aData->size));
+    if (!aData->options.similar.empty() && begin == 0) {
+      Local<Array> aTerms(Array::New(aData->expanded.size()));
+      for (size_t a = 0; a < aData->expanded.size(); ++a)
+        aTerms->Set(a, String::New(aData->expanded[a].data(), aData->expanded[a].size()));
+      aInfo->Set(String::NewSymbol("terms"), aTerms);
+    }
+    if (aData->facetlist.size() && begin == 0) {
+      Local<Object> aFacets(Object::New());
+      for (size_t a = 0; a < aData->facetlist.size(); ++a) {
+        GetMset_data::Facet& aFacet = aData->facetlist[a];
+        Local<Array> aCounts(Array::New(aFacet.counts.size()));
+        for (size_t aC = 0; aC < aFacet.counts.size(); ++aC) {
+          Local<Object> aV(Object::New());
+          aV->Set(String::NewSymbol("value"), newValueBuffer(aFacet.counts[aC].first));
+          aV->Set(String::NewSymbol("count"), Uint32::New(aFacet.counts[aC].second));
+          aCounts->Set(aC, aV);
+        }
+        Local<Object> aF(Object::New());
+        aF->Set(String::NewSymbol("total" ), Uint32::New(aFacet.total));
+        aF->Set(String::NewSymbol("values"), aCounts);
+        aFacets->Set(aFacet.slot, aF);
+      }
+      aInfo->Set(String::NewSymbol("facets"), aFacets);
+    }
+    argv[2] = aInfo;
   }
 
-  tryCallCatch(aData->callback, aData->object->handle_, aData->error ? 1 : 2, argv);
-
-  delete aData;
-
-  return 0;
+  if (aR == 0)
+    tryCallCatch(aData->callback, aData->object->handle_, aData->error ? 1 : 3, argv);
+  else
+    tryCallCatch(aData->waiters[aR-1].callback, aData->waiters[aR-1].context, aData->error ? 1 : 3, argv);
 }
 
 Persistent<FunctionTemplate> Query::constructor_template;
@@ -858,25 +3735,87 @@ void Query::Init(Handle<Object> target) {
 
 Handle<Value> Query::New(const Arguments& args) {
   HandleScope scope;
-  int aN;
-  std::vector<std::string> aList;
-  for (aN = 1; aN < args.Length() && args[aN]->IsString(); ++aN)
-    aList.push_back(*String::Utf8Value(args[aN]));
-  if (args.Length() < 2 || !args[0]->IsInt32() || aN < args.Length())
-    return ThrowException(Exception::TypeError(String::New("arguments are (Query.op, string ...)")));
+  if (args.Length() < 2 || !args[0]->IsInt32())
+    return ThrowException(Exception::TypeError(String::New("arguments are (Query.op, string/Query ...) or (Query.op, slot, value[, value])")));
+  Xapian::Query::op aOp = (Xapian::Query::op)args[0]->Int32Value();
+  bool aRange = aOp == Xapian::Query::OP_VALUE_RANGE || aOp == Xapian::Query::OP_VALUE_GE || aOp == Xapian::Query::OP_VALUE_LE;
+  std::string aLo, aHi;
+  std::vector<Xapian::Query> aList;
+  if (aRange) {
+    if (args.Length() != (aOp == Xapian::Query::OP_VALUE_RANGE ? 4 : 3) || !args[1]->IsUint32() || !valueString(args[2], aLo)
+        || (args.Length() == 4 && !valueString(args[3], aHi)))
+      return ThrowException(Exception::TypeError(String::New("arguments are (OP_VALUE_RANGE, slot, lo, hi) or (OP_VALUE_GE/LE, slot, value), value string/number/Date")));
+  } else {
+    for (int aN = 1; aN < args.Length(); ++aN) {
+      Query* aQ;
+      if (args[aN]->IsString())
+        aList.push_back(Xapian::Query(*String::Utf8Value(args[aN])));
+      else if ((aQ = GetInstance<Query>(args[aN])))
+        aList.push_back(aQ->mQry);
+      else
+        return ThrowException(Exception::TypeError(String::New("arguments are (Query.op, string/Query ...) or (Query.op, slot, value[, value])")));
+    }
+  }
   Query* that;
-  const char* aDesc;
+  std::string aDesc;
   try {
-  that = new Query((Xapian::Query::op)args[0]->Int32Value(), aList.begin(), aList.end());
-  aDesc = that->mQry.get_description().c_str();
+  if (aOp == Xapian::Query::OP_VALUE_RANGE)
+    that = new Query(Xapian::Query(aOp, args[1]->Uint32Value(), aLo, aHi));
+  else if (aRange)
+    that = new Query(Xapian::Query(aOp, args[1]->Uint32Value(), aLo));
+  else
+    that = new Query(Xapian::Query(aOp, aList.begin(), aList.end()));
+  aDesc = that->mQry.get_description();
   } catch (const Xapian::Error& err) {
     return ThrowException(Exception::Error(String::New(err.get_msg().c_str())));
   }
-  args.This()->Set(String::NewSymbol("description"), String::New(aDesc));
+  args.This()->Set(String::NewSymbol("description"), String::New(aDesc.c_str()));
+  that->Wrap(args.This());
+  return args.This();
+}
+
+Persistent<FunctionTemplate> OpHandle::constructor_template;
+
+void OpHandle::Init(Handle<Object> target) {
+  constructor_template = Persistent<FunctionTemplate>::New(FunctionTemplate::New(New));
+  constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+  constructor_template->SetClassName(String::NewSymbol("OpHandle"));
+
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "cancel", Cancel);
+}
+
+Local<Object> OpHandle::NewInstance(AsyncOpBase* op, size_t caller) {
+  Local<Object> aO = constructor_template->GetFunction()->NewInstance();
+  OpHandle* aH = ObjectWrap::Unwrap<OpHandle>(aO);
+  aH->mOp = op;
+  aH->mCaller = caller;
+  op->handles.push_back(&aH->mOp);
+  return aO;
+}
+
+Handle<Value> OpHandle::New(const Arguments& args) {
+  HandleScope scope;
+  OpHandle* that = new OpHandle;
   that->Wrap(args.This());
   return args.This();
 }
 
+// returns false if the callback has already run or been cancelled
+Handle<Value> OpHandle::Cancel(const Arguments& args) {
+  HandleScope scope;
+  OpHandle* that = ObjectWrap::Unwrap<OpHandle>(args.This());
+  if (!that->mOp || that->mOp->isDropped(that->mCaller))
+    return False();
+  AsyncOpBase* aOp = that->mOp;
+  if (aOp->dropCaller(that->mCaller)) {
+    aOp->cancelled = true;
+    aOp->onCancel();
+    if (sExecutor.remove(aOp))
+      delete aOp;
+  }
+  return True();
+}
+
 Persistent<FunctionTemplate> Document::constructor_template;
 
 void Document::Init(Handle<Object> target) {
@@ -885,6 +3824,8 @@ void Document::Init(Handle<Object> target) {
   constructor_template->SetClassName(String::NewSymbol("Document"));
 
   NODE_SET_PROTOTYPE_METHOD(constructor_template, "get_data", GetData);
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "get_values", GetValues);
+  NODE_SET_PROTOTYPE_METHOD(constructor_template, "get_termlist", GetTermlist);
 
   target->Set(String::NewSymbol("Document"), constructor_template->GetFunction());
 }
@@ -895,7 +3836,11 @@ Handle<Value> Document::New(const Arguments& args) {
   if (args.Length() && !args[0]->IsExternal())
     return ThrowException(Exception::TypeError(String::New("arguments are ()")));
 
-  Document* that = new Document(args.Length() ? (Xapian::Document*) External::Unwrap(args[0]) : new Xapian::Document);
+  // internal callers pass (External SharedDoc, [number, [string]]) with an estimate of the
+  // native size and a document cache key
+  size_t aBytes = args.Length() > 1 && args[1]->IsNumber() ? (size_t) args[1]->NumberValue() : kDocumentBytes;
+  std::string aKey(args.Length() > 2 && args[2]->IsString() ? *String::Utf8Value(args[2]) : "");
+  Document* that = new Document(args.Length() ? (SharedDoc*) External::Unwrap(args[0]) : new SharedDoc(Xapian::Document()), aBytes, aKey);
   that->Wrap(args.This());
 
   return args.This();
@@ -908,21 +3853,165 @@ Handle<Value> Document::GetData(const Arguments& args) {
     return ThrowException(Exception::TypeError(String::New("arguments are (function)")));
   GetData_data* aData;
   try {
-    aData = new GetData_data(args.This(), Local<Function>::Cast(args[0]));
+    aData = new GetData_data(args.This(), Local<Function>::Cast(args[0]));
+  } catch (Local<Value> ex) {
+    return ThrowException(ex);
+  }
+
+  sExecutor.submit(GetData_pool, GetData_done, aData);
+
+  return Undefined();
+}
+
+int Document::GetData_pool(eio_req *req) {
+  GetData_data* aData = (GetData_data*) req->data;
+
+  SharedDocLock aLock(aData->object->mDoc);
+  try {
+  aData->data = sDocCache.data(aData->object->mCacheKey, aData->object->mDoc->doc);
+  } catch (const Xapian::Error& err) {
+    aData->error = new Xapian::Error(err);
+  }
+
+  aData->poolDone();
+  return 0;
+}
+
+int Document::GetData_done(eio_req *req) {
+  HandleScope scope;
+
+  GetData_data* aData = (GetData_data*) req->data;
+
+  Handle<Value> argv[2];
+  if (aData->error) {
+    argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
+  } else {
+    argv[0] = Null();
+    argv[1] = String::New(aData->data.c_str());
+  }
+
+  tryCallCatch(aData->callback, aData->object->handle_, aData->error ? 1 : 2, argv);
+
+  delete aData;
+
+  return 0;
+}
+
+Handle<Value> Document::GetValues(const Arguments& args) {
+  HandleScope scope;
+
+  int aCb = args.Length() > 1 ? 1 : 0;
+  if (args.Length() < 1 || (aCb == 1 && !args[0]->IsArray()) || !args[aCb]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are ([array,] function)")));
+  std::vector<Xapian::valueno> aSlots;
+  if (aCb == 1) {
+    Local<Array> aAry = Local<Array>::Cast(args[0]);
+    for (uint32_t a = 0; a < aAry->Length(); ++a) {
+      Local<Value> aVal = aAry->Get(a);
+      if (!aVal->IsUint32())
+        return ThrowException(Exception::TypeError(String::New("slot list member not a number")));
+      aSlots.push_back(aVal->Uint32Value());
+    }
+  }
+  GetValues_data* aData;
+  try {
+    aData = new GetValues_data(args.This(), Local<Function>::Cast(args[aCb]));
+  } catch (Local<Value> ex) {
+    return ThrowException(ex);
+  }
+  aData->slots.swap(aSlots);
+
+  sExecutor.submit(GetValues_pool, GetValues_done, aData);
+
+  return Undefined();
+}
+
+int Document::GetValues_pool(eio_req *req) {
+  GetValues_data* aData = (GetValues_data*) req->data;
+
+  SharedDocLock aLock(aData->object->mDoc);
+  try {
+  if (!aData->slots.empty() && !aData->object->mCacheKey.empty()
+      && sDocCache.get(aData->object->mCacheKey, NULL, &aData->slots, &aData->values)) {
+    // all requested slots were cached
+  } else if (aData->slots.empty()) {
+    const Xapian::Document& aDoc = aData->object->mDoc->doc;
+    for (Xapian::ValueIterator a = aDoc.values_begin(); a != aDoc.values_end(); ++a)
+      aData->values.push_back(std::make_pair(a.get_valueno(), *a));
+  } else {
+    for (size_t a = 0; a < aData->slots.size(); ++a) {
+      std::string aVal(aData->object->mDoc->doc.get_value(aData->slots[a]));
+      if (!aVal.empty())
+        aData->values.push_back(std::make_pair(aData->slots[a], aVal));
+    }
+  }
+  } catch (const Xapian::Error& err) {
+    aData->error = new Xapian::Error(err);
+  }
+
+  aData->poolDone();
+  return 0;
+}
+
+int Document::GetValues_done(eio_req *req) {
+  HandleScope scope;
+
+  GetValues_data* aData = (GetValues_data*) req->data;
+
+  Handle<Value> argv[2];
+  if (aData->error) {
+    argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
+  } else {
+    argv[0] = Null();
+    Local<Object> aO(Object::New());
+    for (size_t a = 0; a < aData->values.size(); ++a)
+      aO->Set(aData->values[a].first, newValueBuffer(aData->values[a].second));
+    argv[1] = aO;
+  }
+
+  tryCallCatch(aData->callback, aData->object->handle_, aData->error ? 1 : 2, argv);
+
+  delete aData;
+
+  return 0;
+}
+
+Handle<Value> Document::GetTermlist(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() < 2 || !args[0]->IsBoolean() || !args[1]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (boolean, function)")));
+  GetTermlist_data* aData;
+  try {
+    aData = new GetTermlist_data(args.This(), Local<Function>::Cast(args[1]), args[0]->BooleanValue());
   } catch (Local<Value> ex) {
     return ThrowException(ex);
   }
 
-  eio_custom(GetData_pool, EIO_PRI_DEFAULT, GetData_done, aData);
+  sExecutor.submit(GetTermlist_pool, GetTermlist_done, aData);
 
   return Undefined();
 }
 
-int Document::GetData_pool(eio_req *req) {
-  GetData_data* aData = (GetData_data*) req->data;
+int Document::GetTermlist_pool(eio_req *req) {
+  GetTermlist_data* aData = (GetTermlist_data*) req->data;
 
+  SharedDocLock aLock(aData->object->mDoc);
   try {
-  aData->data = aData->object->mDoc->get_data();
+  Xapian::Document* aDoc = &aData->object->mDoc->doc;
+  aData->terms.reserve(aDoc->termlist_count());
+  aData->wdf.reserve(aDoc->termlist_count());
+  for (Xapian::TermIterator a = aDoc->termlist_begin(); a != aDoc->termlist_end(); ++a) {
+    aData->terms.push_back(*a);
+    aData->wdf.push_back(a.get_wdf());
+    if (aData->withpositions) {
+      aData->offsets.push_back(aData->positions.size());
+      for (Xapian::PositionIterator aP = a.positionlist_begin(); aP != a.positionlist_end(); ++aP)
+        aData->positions.push_back(*aP);
+    }
+  }
+  if (aData->withpositions)
+    aData->offsets.push_back(aData->positions.size());
   } catch (const Xapian::Error& err) {
     aData->error = new Xapian::Error(err);
   }
@@ -931,17 +4020,31 @@ int Document::GetData_pool(eio_req *req) {
   return 0;
 }
 
-int Document::GetData_done(eio_req *req) {
+static Handle<Object> newUint32Buffer(const std::vector<uint32_t>& list) {
+  return Buffer::New(list.empty() ? NULL : (char*) &list[0], list.size() * sizeof(uint32_t))->handle_;
+}
+
+int Document::GetTermlist_done(eio_req *req) {
   HandleScope scope;
 
-  GetData_data* aData = (GetData_data*) req->data;
+  GetTermlist_data* aData = (GetTermlist_data*) req->data;
 
   Handle<Value> argv[2];
   if (aData->error) {
     argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
   } else {
     argv[0] = Null();
-    argv[1] = String::New(aData->data.c_str());
+    Local<Array> aTerms(Array::New(aData->terms.size()));
+    for (size_t a = 0; a < aData->terms.size(); ++a)
+      aTerms->Set(a, String::New(aData->terms[a].data(), aData->terms[a].size()));
+    Local<Object> aO(Object::New());
+    aO->Set(String::NewSymbol("terms"), aTerms);
+    aO->Set(String::NewSymbol("wdf"  ), newUint32Buffer(aData->wdf));
+    if (aData->withpositions) {
+      aO->Set(String::NewSymbol("position_offsets"), newUint32Buffer(aData->offsets));
+      aO->Set(String::NewSymbol("positions"       ), newUint32Buffer(aData->positions));
+    }
+    argv[1] = aO;
   }
 
   tryCallCatch(aData->callback, aData->object->handle_, aData->error ? 1 : 2, argv);
@@ -978,17 +4081,37 @@ Handle<Value> Mime2Text::New(const Arguments& args) {
 Handle<Value> Mime2Text::Convert(const Arguments& args) {
   HandleScope scope;
 
-  if (args.Length() < 3 || !args[0]->IsString() || (!args[1]->IsString() && !args[1]->IsNull()) || !args[2]->IsFunction())
-    return ThrowException(Exception::TypeError(String::New("arguments are (string, string|null, function)")));
+  int aCb = args.Length() > 3 ? 3 : 2;
+  if (args.Length() < 3 || !args[0]->IsString() || (!args[1]->IsString() && !args[1]->IsNull()) || (aCb == 3 && !args[2]->IsObject())
+      || !args[aCb]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (string, string|null, [object,] function)")));
+  size_t aChunk = 0;
+  double aBudget = kTickBudget;
+  if (aCb == 3) {
+    Local<Object> aOpt = args[2]->ToObject();
+    Local<String> aKey;
+    if (aOpt->Has(aKey = String::New("body_chunk"))) {
+      if (!aOpt->Get(aKey)->IsUint32())
+        return ThrowException(Exception::TypeError(String::New("options object body_chunk not a number")));
+      aChunk = aOpt->Get(aKey)->Uint32Value();
+    }
+    if (aOpt->Has(aKey = String::New("tick_budget"))) {
+      if (!aOpt->Get(aKey)->IsNumber() || aOpt->Get(aKey)->NumberValue() < 0)
+        return ThrowException(Exception::TypeError(String::New("options object tick_budget not a positive number")));
+      aBudget = aOpt->Get(aKey)->NumberValue() / 1000;
+    }
+  }
   Convert_data* aData;
   try {
-    aData = new Convert_data(args.This(), Local<Function>::Cast(args[2]), args[0]->ToString(), args[1]);
+    aData = new Convert_data(args.This(), Local<Function>::Cast(args[aCb]), args[0]->ToString(), args[1]);
     aData->poolDone(); // concurrent access ok
   } catch (Local<Value> ex) {
     return ThrowException(ex);
   }
+  aData->chunk = aChunk;
+  aData->budget = aBudget;
 
-  eio_custom(Convert_pool, EIO_PRI_DEFAULT, Convert_done, aData);
+  sExecutor.submit(Convert_pool, Convert_done, aData);
 
   return Undefined();
 }
@@ -1015,6 +4138,11 @@ int Mime2Text::Convert_done(eio_req *req) {
 
   Convert_data* aData = (Convert_data*) req->data;
 
+  if (!aData->error && aData->chunk) {
+    aData->run();
+    return 0;
+  }
+
   Handle<Value> argv[2];
   if (aData->error) {
     argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
@@ -1039,6 +4167,31 @@ int Mime2Text::Convert_done(eio_req *req) {
   return 0;
 }
 
+// with body_chunk, the first call gets every field and the first part of body,
+// later calls get { body: part }; argument 3 is true until the last part
+bool Mime2Text::Convert_data::slice() {
+  const std::string& aBody = fields.dump;
+  HandleScope scope;
+  size_t aEnd = std::min(offset + chunk, aBody.size());
+  while (aEnd < aBody.size() && (aBody[aEnd] & 0xC0) == 0x80) // not within a UTF-8 sequence
+    ++aEnd;
+  Local<Object> aO(Object::New());
+  if (offset == 0) {
+    aO->Set(String::NewSymbol("title"   ), String::New(fields.title.c_str()));
+    aO->Set(String::NewSymbol("author"  ), String::New(fields.author.c_str()));
+    aO->Set(String::NewSymbol("keywords"), String::New(fields.keywords.c_str()));
+    aO->Set(String::NewSymbol("sample"  ), String::New(fields.sample.c_str()));
+    aO->Set(String::NewSymbol("md5"     ), String::New(fields.md5.c_str()));
+    aO->Set(String::NewSymbol("mimetype"), String::New(fields.mimetype.c_str()));
+    aO->Set(String::NewSymbol("command" ), String::New(fields.command.c_str()));
+  }
+  aO->Set(String::NewSymbol("body"    ), String::New(aBody.data() + offset, aEnd - offset));
+  offset = aEnd;
+  Handle<Value> argv[] = { Null(), aO, Boolean::New(offset < aBody.size()) };
+  tryCallCatch(callback, object->handle_, 3, argv);
+  return offset >= aBody.size();
+}
+
 
 /*
 document input object: {
@@ -1046,12 +4199,41 @@ document input object: {
   id_term: string, // boolean term; if found in index, replace/delete that document
   data: string, // pass to Document::set_data()
   text: [ string/buffer, ... ], // pass to TermGenerator::index_text()
-  file: { path: string, mime_t: string, ... }, // invoke format converter library, then index_text()
+  fields: { name: { prefix: string, weight: number, text: string }, ... }, // index text with wdf multiplier weight,
+    // both plain and with the term prefix; without text, title/author/keywords/body set those for the file's metadata
+  file: { path: string, mime_t: string, md5_slot: number, ... }, // invoke format converter library, then index_text();
+                                                   // md5_slot gets file md5 for Enquire::set_collapse_key()
   terms: { term: wdfinc, ... }, // pass to Document::add_term()
-  values: { slot: value, ... } // pass to Document::add_value()
+  values: { slot: value, ... } // pass to Document::add_value(); number and Date (ms) values are sortable_serialise()d
 }
 */
 
+// parses { prefix: string, weight: number, text: string }; all members optional
+static Handle<Value> parseFieldSpec(Handle<Value> spec, std::string& prefix, Xapian::termcount& weight, Local<Value>* text) {
+  if (!spec->IsObject())
+    return Exception::TypeError(String::New("fields object member not an object"));
+  Local<Object> aSpec = spec->ToObject();
+  Local<String> aKey;
+  Local<Value> aVal;
+  prefix.clear();
+  weight = 1;
+  if (aSpec->Has(aKey = String::New("prefix"))) {
+    aVal = aSpec->Get(aKey);
+    if (!aVal->IsString())
+      return Exception::TypeError(String::New("fields object member prefix not a string"));
+    prefix = *String::Utf8Value(aVal);
+  }
+  if (aSpec->Has(aKey = String::New("weight"))) {
+    aVal = aSpec->Get(aKey);
+    if (!aVal->IsUint32() || aVal->Uint32Value() == 0)
+      return Exception::TypeError(String::New("fields object member weight not a positive integer"));
+    weight = aVal->Uint32Value();
+  }
+  if (text && aSpec->Has(aKey = String::New("text")))
+    *text = aSpec->Get(aKey);
+  return Handle<Value>();
+}
+
 static Handle<Value> AssembleDocument(const Arguments& args) {
   HandleScope scope;
 
@@ -1060,11 +4242,16 @@ static Handle<Value> AssembleDocument(const Arguments& args) {
   if (args.Length() < 4 || !(aTg = GetInstance<TermGenerator>(args[0])) || !(aM2t = GetInstance<Mime2Text>(args[1]))
    || !args[2]->IsObject() || !args[3]->IsFunction())
     return ThrowException(Exception::TypeError(String::New("arguments are (TermGenerator, Mime2Text, object, function)")));
+  if (aTg->mBusy)
+    return ThrowException(Exception::Error(kBusyMsg));
 
   Local<Object> aO = args[2]->ToObject();
   Local<String> aKey;
   Local<Value> aVal, aPath, aMime;
-  String::Utf8Value** aTextList = NULL;
+  Xapian::valueno aMd5Slot = Xapian::BAD_VALUENO;
+  Main_data::Text* aText = NULL;
+  size_t aTextBytes = 0;
+  FieldMap aFieldMap;
   Xapian::Document aDoc;
   try {
     if (aO->Has(aKey = String::New("id_term"))) {
@@ -1092,6 +4279,12 @@ static Handle<Value> AssembleDocument(const Arguments& args) {
         if (!aMime->IsString())
           return ThrowException(Exception::TypeError(String::New("input object file.mime_t not a string")));
       }
+      if (aFile->Has(aKey = String::New("md5_slot"))) {
+        Local<Value> aSlot = aFile->Get(aKey);
+        if (!aSlot->IsUint32())
+          return ThrowException(Exception::TypeError(String::New("input object file.md5_slot not a number")));
+        aMd5Slot = aSlot->Uint32Value();
+      }
     }
     if (aO->Has(aKey = String::New("terms"))) {
       aVal = aO->Get(aKey);
@@ -1115,9 +4308,9 @@ static Handle<Value> AssembleDocument(const Arguments& args) {
         aVal = aNames->Get(a);
         if (aVal->IsUint32()) {
           uint32_t aSlot = aVal->Uint32Value();
-          aVal = aValues->Get(aSlot);
-          if (aVal->IsString())
-            aDoc.add_value(aSlot, *String::Utf8Value(aVal));
+          std::string aStr;
+          if (valueString(aValues->Get(aSlot), aStr))
+            aDoc.add_value(aSlot, aStr);
         }
       }
     }
@@ -1126,10 +4319,48 @@ static Handle<Value> AssembleDocument(const Arguments& args) {
       if (!aVal->IsArray())
         return ThrowException(Exception::TypeError(String::New("input object text not an array")));
       Local<Array> aAry = Local<Array>::Cast(aVal);
-      aTextList = new String::Utf8Value*[aAry->Length()+1];
+      aText = Main_data::sText.take();
       for (uint32_t a = 0; a < aAry->Length(); ++a)
-        aTextList[a] = new String::Utf8Value(aAry->Get(a));
-      aTextList[aAry->Length()] = NULL;
+        aText->add(aAry->Get(a)->ToString(), std::string(), 1);
+    }
+    if (aO->Has(aKey = String::New("fields"))) {
+      aVal = aO->Get(aKey);
+      if (!aVal->IsObject()) {
+        if (aText) Main_data::giveText(aText);
+        return ThrowException(Exception::TypeError(String::New("input object fields not an object")));
+      }
+      Local<Object> aFields = aVal->ToObject();
+      Local<Array> aNames = aFields->GetPropertyNames();
+      for (uint32_t a = 0; a < aNames->Length(); ++a) {
+        Local<String> aName = aNames->Get(a)->ToString();
+        std::string aPrefix;
+        Xapian::termcount aWeight;
+        Local<Value> aFieldText;
+        Handle<Value> aErr = parseFieldSpec(aFields->Get(aName), aPrefix, aWeight, &aFieldText);
+        if (!aErr.IsEmpty()) {
+          if (aText) Main_data::giveText(aText);
+          return ThrowException(aErr);
+        }
+        if (!aFieldText.IsEmpty()) {
+          if (!aText)
+            aText = Main_data::sText.take();
+          aText->add(aFieldText->ToString(), aPrefix, aWeight);
+          continue;
+        }
+        for (int aF = 0; aF < FieldMap::eFields; ++aF) {
+          if (strcmp(*String::Utf8Value(aName), kFieldNames[aF]) == 0) {
+            aFieldMap.prefix[aF] = aPrefix;
+            aFieldMap.weight[aF] = aWeight;
+          }
+        }
+      }
+    }
+    if (aText) {
+      aTextBytes = aText->buffer.size();
+      if (sOpMemoryLimit && aTextBytes > sOpMemoryLimit) {
+        Main_data::giveText(aText);
+        return ThrowException(Exception::RangeError(String::New("input object text exceeds memory limit")));
+      }
     }
     if (aVal.IsEmpty())
       return ThrowException(Exception::TypeError(String::New("input object has no relevant members")));
@@ -1137,46 +4368,645 @@ static Handle<Value> AssembleDocument(const Arguments& args) {
     return ThrowException(Exception::Error(String::New(err.get_msg().c_str())));
   }
 
-  Main_data* aData = new Main_data(Local<Function>::Cast(args[3]), new Xapian::Document(aDoc), aTg, aTextList, aM2t, aPath, aMime);
+  Main_data* aData = new Main_data(Local<Function>::Cast(args[3]), aDoc, aTg, aText, aM2t, aPath, aMime, aMd5Slot);
+  aData->fieldmap = aFieldMap;
+  aData->holdMemory(eMemAssemble, sizeof(Main_data) + aTextBytes);
 
-  eio_custom(Main_pool, EIO_PRI_DEFAULT, Main_done, aData);
+  sExecutor.submit(Main_pool, Main_done, aData);
 
-  return Undefined();
+  return scope.Close(OpHandle::NewInstance(aData));
+}
+
+// indexes the text of a converted file, as omindex does
+static void indexFields(Xapian::TermGenerator& tg, const Xapian::Mime2Text::Fields& fields, const FieldMap& map) {
+  const std::string* aText[FieldMap::eFields] = { &fields.title, &fields.author, &fields.keywords, &fields.dump };
+  for (int a = 0; a < FieldMap::eFields; ++a) {
+    if (aText[a]->empty())
+      continue;
+    tg.index_text(*aText[a], map.weight[a]);
+    if (!map.prefix[a].empty())
+      tg.index_text(*aText[a], map.weight[a], map.prefix[a]);
+    tg.increase_termpos();
+  }
 }
 
 static int Main_pool(eio_req *req) {
   Main_data* aData = (Main_data*) req->data;
 
   try {
-  aData->termgen->mTg.set_document(*aData->document);
-  for (int a = 0; aData->textlist && aData->textlist[a]; ++a) {
-    aData->termgen->mTg.index_text(Xapian::Utf8Iterator(**aData->textlist[a], aData->textlist[a]->length()));
+  aData->termgen->mTg.set_document(aData->document);
+  size_t aIndexed = 0; // postings and positions grow about as the text indexed
+  for (size_t a = 0; aData->text && a < aData->text->segments.size() && !aData->cancelled; ++a) {
+    const Main_data::Text::Segment& aSeg = aData->text->segments[a];
+    aIndexed += aSeg.prefix.empty() ? aSeg.length : 2 * aSeg.length;
+    checkOpMemory(aData->membytes + aIndexed, "assembled document");
+    const char* aStart = aData->text->buffer.data() + aSeg.offset;
+    aData->termgen->mTg.index_text(Xapian::Utf8Iterator(aStart, aSeg.length), aSeg.weight);
+    if (!aSeg.prefix.empty())
+      aData->termgen->mTg.index_text(Xapian::Utf8Iterator(aStart, aSeg.length), aSeg.weight, aSeg.prefix);
     aData->termgen->mTg.increase_termpos();
   }
-  if (aData->path.length()) {
+  if (aData->path.length() && !aData->cancelled) {
     int aStatus = aData->mime2text->m2T.convert(*aData->path, aData->mimetype.length() ? *aData->mimetype : NULL, &aData->fields);
     if (aStatus != Xapian::Mime2Text::Status_OK) {
       std::string aMsg("Mime2Text::convert error: ");
       aMsg += (char) (aStatus + '0');
       throw Xapian::InternalError(aMsg);
     }
-    if (!aData->fields.title.empty()) {
-      aData->termgen->mTg.index_text(aData->fields.title);
-      aData->termgen->mTg.increase_termpos();
+    aData->fieldbytes = aData->fields.title.size() + aData->fields.author.size() + aData->fields.keywords.size() + aData->fields.dump.size();
+    checkOpMemory(aData->membytes + aData->fieldbytes, "converted file");
+    if (aData->md5slot != Xapian::BAD_VALUENO)
+      aData->document.add_value(aData->md5slot, aData->fields.md5);
+    indexFields(aData->termgen->mTg, aData->fields, aData->fieldmap);
+  }
+  } catch (const Xapian::Error& err) {
+    aData->error = new Xapian::Error(err);
+  }
+
+  return 0;
+}
+
+static int Main_done(eio_req *req) {
+  HandleScope scope;
+
+  Main_data* aData = (Main_data*) req->data;
+
+  Handle<Value> argv[2];
+  if (aData->error) {
+    argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
+  } else {
+    argv[0] = Null();
+    aData->holdMemory(eMemAssemble, aData->fieldbytes);
+    // postings and positions grow with the text indexed
+    Local<Value> aDoc[] = { External::New(new SharedDoc(aData->document)), Number::New(kDocumentBytes + aData->membytes) };
+    argv[1] = Document::constructor_template->GetFunction()->NewInstance(2, aDoc);
+  }
+
+  tryCallCatch(aData->callback, Context::GetCurrent()->Global(), aData->error ? 1 : 2, argv);
+
+  delete aData;
+
+  return 0;
+}
+
+/*
+index_directory(TermGenerator, Mime2Text, root, options, function)
+  options: {
+    // all members optional
+    id_prefix: string, // unique term is prefix + path, default 'Q'
+    mtime_slot: number|null, // values compared to skip unchanged files, default 0
+    size_slot: number|null, // default 1
+    md5_slot: number|null, // default null; a changed file with the same md5 isn't converted, only has its values updated
+    fields: { title|author|keywords|body: { prefix: string, weight: number } }, // as for assemble_document
+    parallel: number, // directories listed and files converted at once in the pool, default 4
+    batch_size: number, // documents written per pool job, default 100
+    commit: boolean, // commit after each batch, and after pruning, default true
+    prune: boolean, // delete documents under root whose files are gone, default false; documents under
+      // a directory or file that couldn't be listed or stat()ed are kept
+    progress: function // called with { phase: 'walk'|'index', files, unchanged, indexed, updated, failed, deleted, pending }
+  }
+  function(err, summary) // summary has the progress members plus seconds, and errors: [ 'path: reason', ... ]
+    // for paths that couldn't be listed, each also counted in failed; err if root can't be listed
+  paths whose id term would exceed 240 bytes get a hashed one, as omindex does
+  TermGenerator is busy until function is called
+*/
+
+Handle<Value> WritableDatabase::IndexDirectory(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() < 5 || !GetInstance<TermGenerator>(args[0]) || !GetInstance<Mime2Text>(args[1]) || !args[2]->IsString()
+   || !args[3]->IsObject() || !args[4]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (TermGenerator, Mime2Text, string, object, function)")));
+  if (GetInstance<TermGenerator>(args[0])->mBusy)
+    return ThrowException(Exception::Error(kBusyMsg));
+
+  IndexDirectory_data* aData;
+  try {
+    aData = new IndexDirectory_data(args.This(), Local<Function>::Cast(args[4]), args[0]->ToObject(), args[1]->ToObject(), args[2]);
+  } catch (Local<Value> ex) {
+    return ThrowException(ex);
+  }
+  aData->termgen = GetInstance<TermGenerator>(args[0]);
+  aData->termgen->mBusy = true;
+  aData->mime2text = GetInstance<Mime2Text>(args[1]);
+
+  Local<Object> aOpt = args[3]->ToObject();
+  Local<String> aKey;
+  Local<Value> aVal;
+  if (aOpt->Has(aKey = String::New("id_prefix"))) {
+    aVal = aOpt->Get(aKey);
+    if (!aVal->IsString()) {
+      delete aData;
+      return ThrowException(Exception::TypeError(String::New("options object id_prefix not a string")));
+    }
+    aData->idprefix = *String::Utf8Value(aVal);
+  }
+  const char* aSlotName[] = { "mtime_slot", "size_slot", "md5_slot" };
+  Xapian::valueno* aSlot[] = { &aData->mtimeslot, &aData->sizeslot, &aData->md5slot };
+  for (int a = 0; a < 3; ++a) {
+    if (aOpt->Has(aKey = String::New(aSlotName[a]))) {
+      aVal = aOpt->Get(aKey);
+      if (!aVal->IsUint32() && !aVal->IsNull()) {
+        delete aData;
+        return ThrowException(Exception::TypeError(String::Concat(String::New("options object member not a number or null: "), aKey)));
+      }
+      *aSlot[a] = aVal->IsNull() ? Xapian::BAD_VALUENO : aVal->Uint32Value();
+    }
+  }
+  const char* aSizeName[] = { "parallel", "batch_size" };
+  size_t* aSize[] = { &aData->parallel, &aData->batchsize };
+  for (int a = 0; a < 2; ++a) {
+    if (aOpt->Has(aKey = String::New(aSizeName[a]))) {
+      aVal = aOpt->Get(aKey);
+      if (!aVal->IsUint32() || aVal->Uint32Value() == 0) {
+        delete aData;
+        return ThrowException(Exception::TypeError(String::Concat(String::New("options object member not a positive integer: "), aKey)));
+      }
+      *aSize[a] = aVal->Uint32Value();
+    }
+  }
+  if (aOpt->Has(aKey = String::New("fields"))) {
+    aVal = aOpt->Get(aKey);
+    if (!aVal->IsObject()) {
+      delete aData;
+      return ThrowException(Exception::TypeError(String::New("options object fields not an object")));
+    }
+    for (int a = 0; a < FieldMap::eFields; ++a) {
+      if (!aVal->ToObject()->Has(aKey = String::New(kFieldNames[a])))
+        continue;
+      Handle<Value> aErr = parseFieldSpec(aVal->ToObject()->Get(aKey), aData->fieldmap.prefix[a], aData->fieldmap.weight[a], NULL);
+      if (!aErr.IsEmpty()) {
+        delete aData;
+        return ThrowException(aErr);
+      }
+    }
+  }
+  if (aOpt->Has(aKey = String::New("commit")))
+    aData->commit = aOpt->Get(aKey)->BooleanValue();
+  if (aOpt->Has(aKey = String::New("prune")))
+    aData->prune = aOpt->Get(aKey)->BooleanValue();
+  if (aOpt->Has(aKey = String::New("progress"))) {
+    aVal = aOpt->Get(aKey);
+    if (!aVal->IsFunction()) {
+      delete aData;
+      return ThrowException(Exception::TypeError(String::New("options object progress not a function")));
+    }
+    aData->progress = Persistent<Function>::New(Local<Function>::Cast(aVal));
+  }
+
+  aData->dirs.push_back(aData->root);
+  IndexWalk_next(aData);
+
+  return Undefined();
+}
+
+// an id term over Xapian's length limit keeps its start and gets a hash of the
+// whole in place of the rest, as omindex's hash_long_term() does
+static const size_t kMaxIdTerm = 240;
+static const size_t kIdHashLength = 8;
+
+static std::string hashLongTerm(const std::string& term) {
+  if (term.size() <= kMaxIdTerm)
+    return term;
+  uint32_t aHash = 5381;
+  for (size_t a = 0; a < term.size(); ++a)
+    aHash = aHash * 33 ^ (unsigned char) term[a];
+  char aHex[kIdHashLength + 1];
+  snprintf(aHex, sizeof(aHex), "%08x", aHash);
+  return term.substr(0, kMaxIdTerm - kIdHashLength) + aHex;
+}
+
+// whether the path in idterm is, or is under, one of paths; a hashed idterm
+// matches on the start it kept, so it's kept when in doubt
+static bool underPaths(const std::string& idterm, size_t prefixlen, const std::vector<std::string>& paths) {
+  bool aHashed = idterm.size() == kMaxIdTerm;
+  std::string aPath(idterm, prefixlen, idterm.size() - prefixlen - (aHashed ? kIdHashLength : 0));
+  for (size_t a = 0; a < paths.size(); ++a) {
+    const std::string& aDir = paths[a];
+    if (aHashed && aDir.size() >= aPath.size()) {
+      if (aDir.compare(0, aPath.size(), aPath) == 0)
+        return true;
+    } else if (aPath.compare(0, aDir.size(), aDir) == 0 && (aPath.size() == aDir.size() || aPath[aDir.size()] == '/')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// lists one directory; skips dot files and symlinks, as omindex does by default
+int WritableDatabase::IndexList_pool(eio_req *req) {
+  IndexList_data* aList = (IndexList_data*) req->data;
+
+  DIR* aD = opendir(aList->dir.c_str());
+  if (!aD) {
+    aList->error = errno;
+    return 0;
+  }
+  aList->error = 0;
+  struct dirent* aE;
+  while ((aE = readdir(aD))) {
+    if (aE->d_name[0] == '.')
+      continue;
+    std::string aPath(aList->dir);
+    aPath += '/';
+    aPath += aE->d_name;
+    struct stat aSt;
+    if (lstat(aPath.c_str(), &aSt) != 0) {
+      aList->unstatted.push_back(std::make_pair(aPath, errno));
+      continue;
+    }
+    if (S_ISDIR(aSt.st_mode)) {
+      aList->dirs.push_back(aPath);
+    } else if (S_ISREG(aSt.st_mode)) {
+      aList->files.push_back(IndexDirectory_data::File());
+      aList->files.back().path = aPath;
+      aList->files.back().mtime = aSt.st_mtime;
+      aList->files.back().size = aSt.st_size;
+    }
+  }
+  closedir(aD);
+
+  return 0;
+}
+
+int WritableDatabase::IndexList_done(eio_req *req) {
+  HandleScope scope;
+
+  IndexList_data* aList = (IndexList_data*) req->data;
+  IndexDirectory_data* aData = aList->group;
+  --aData->listing;
+  if (aList->error && aList->dir == aData->root) { // nothing was walked, so nothing may be pruned
+    aData->error = new Xapian::InvalidArgumentError("index_directory root " + aList->dir + ": " + strerror(aList->error));
+    delete aList;
+    IndexDirectory_next(aData);
+    return 0;
+  }
+  if (aList->error)
+    aList->unstatted.push_back(std::make_pair(aList->dir, aList->error));
+  for (size_t a = 0; a < aList->unstatted.size(); ++a) {
+    aData->unlisted.push_back(aList->unstatted[a].first);
+    aData->errors.push_back(aList->unstatted[a].first + ": " + strerror(aList->unstatted[a].second));
+    ++aData->failed;
+  }
+  aData->dirs.insert(aData->dirs.end(), aList->dirs.begin(), aList->dirs.end());
+  aData->files.insert(aData->files.end(), aList->files.begin(), aList->files.end());
+  delete aList;
+  IndexWalk_next(aData);
+
+  return 0;
+}
+
+// lists up to parallel directories at once in the pool; once all are listed,
+// compares the files found with the index
+void WritableDatabase::IndexWalk_next(IndexDirectory_data* data) {
+  while (data->listing < data->parallel && !data->dirs.empty()) {
+    IndexList_data* aList = new IndexList_data;
+    aList->group = data;
+    aList->error = 0;
+    aList->dir.swap(data->dirs.back());
+    data->dirs.pop_back();
+    ++data->listing;
+    sExecutor.submit(IndexList_pool, IndexList_done, aList);
+  }
+  if (data->listing == 0)
+    sExecutor.submit(IndexWalk_pool, IndexWalk_done, data);
+}
+
+int WritableDatabase::IndexWalk_pool(eio_req *req) {
+  IndexDirectory_data* aData = (IndexDirectory_data*) req->data;
+
+  std::vector<IndexDirectory_data::File> aFound;
+  aFound.swap(aData->files);
+  aData->seen = aFound.size();
+
+  try {
+  Xapian::WritableDatabase& aDb = *aData->object->mWdb;
+  std::set<std::string> aSeen;
+  for (size_t a = 0; a < aFound.size(); ++a) {
+    IndexDirectory_data::File& aF = aFound[a];
+    aF.idterm = hashLongTerm(aData->idprefix + aF.path);
+    aF.docid = 0;
+    aF.failed = false;
+    aF.samemd5 = false;
+    if (aData->prune)
+      aSeen.insert(aF.idterm);
+    Xapian::PostingIterator aP = aDb.postlist_begin(aF.idterm);
+    if (aP != aDb.postlist_end(aF.idterm)) {
+      aF.docid = *aP;
+      Xapian::Document aDoc = aDb.get_document(aF.docid);
+      bool aSame = aData->mtimeslot != Xapian::BAD_VALUENO || aData->sizeslot != Xapian::BAD_VALUENO;
+      if (aData->mtimeslot != Xapian::BAD_VALUENO && aDoc.get_value(aData->mtimeslot) != Xapian::sortable_serialise(aF.mtime))
+        aSame = false;
+      if (aData->sizeslot != Xapian::BAD_VALUENO && aDoc.get_value(aData->sizeslot) != Xapian::sortable_serialise(aF.size))
+        aSame = false;
+      if (aSame) {
+        ++aData->unchanged;
+        continue;
+      }
+      if (aData->md5slot != Xapian::BAD_VALUENO)
+        aF.oldmd5 = aDoc.get_value(aData->md5slot);
+    }
+    aData->files.push_back(aF);
+  }
+  if (aData->prune) {
+    std::string aPrefix(aData->idprefix + aData->root + '/');
+    std::vector<std::string> aGone;
+    for (Xapian::TermIterator a = aDb.allterms_begin(aPrefix); a != aDb.allterms_end(aPrefix); ++a)
+      if (!aSeen.count(*a) && !underPaths(*a, aData->idprefix.size(), aData->unlisted))
+        aGone.push_back(*a);
+    for (size_t a = 0; a < aGone.size(); ++a)
+      aDb.delete_document(aGone[a]);
+    aData->deleted = aGone.size();
+    if (aData->commit && aGone.size()) // no batch may follow
+      aDb.commit();
+  }
+  } catch (const Xapian::Error& err) {
+    aData->error = new Xapian::Error(err);
+  }
+
+  return 0;
+}
+
+int WritableDatabase::IndexWalk_done(eio_req *req) {
+  HandleScope scope;
+
+  IndexDirectory_data* aData = (IndexDirectory_data*) req->data;
+  if (!aData->error)
+    IndexDirectory_progress(aData, "walk");
+  IndexDirectory_next(aData);
+
+  return 0;
+}
+
+int WritableDatabase::IndexConvert_pool(eio_req *req) {
+  IndexStep_data* aStep = (IndexStep_data*) req->data;
+  IndexDirectory_data::File& aF = aStep->group->files[aStep->items[0]];
+
+  // a file whose content is unchanged needs only its values updated
+  if (!aF.oldmd5.empty()) {
+    std::string aMd5;
+    if (md5_file(aF.path, aMd5, true) && aMd5 == aF.oldmd5) {
+      aF.samemd5 = true;
+      return 0;
+    }
+  }
+  if (aStep->converter->convert(aF.path.c_str(), NULL, &aF.fields) != Xapian::Mime2Text::Status_OK)
+    aF.failed = true;
+
+  return 0;
+}
+
+int WritableDatabase::IndexConvert_done(eio_req *req) {
+  HandleScope scope;
+
+  IndexStep_data* aStep = (IndexStep_data*) req->data;
+  IndexDirectory_data* aData = aStep->group;
+  --aData->converting;
+  aData->converters.push_back(aStep->converter);
+  aData->ready.push_back(aStep->items[0]);
+  delete aStep;
+  IndexDirectory_next(aData);
+
+  return 0;
+}
+
+int WritableDatabase::IndexBatch_pool(eio_req *req) {
+  IndexStep_data* aStep = (IndexStep_data*) req->data;
+  IndexDirectory_data* aData = aStep->group;
+
+  try {
+  Xapian::WritableDatabase& aDb = *aData->object->mWdb;
+  Xapian::TermGenerator& aTg = aData->termgen->mTg;
+  for (size_t a = 0; a < aStep->items.size(); ++a) {
+    IndexDirectory_data::File& aF = aData->files[aStep->items[a]];
+    if (aF.failed) {
+      ++aData->failed;
+      continue;
     }
-    if (!aData->fields.author.empty()) {
-      aData->termgen->mTg.index_text(aData->fields.author);
-      aData->termgen->mTg.increase_termpos();
+    Xapian::Document aDoc;
+    bool aSame = aF.docid && (aF.samemd5 || (!aF.oldmd5.empty() && aF.oldmd5 == aF.fields.md5));
+    if (aSame) {
+      aDoc = aDb.get_document(aF.docid);
+    } else {
+      aDoc.set_data("url=" + aF.path + "\nsample=" + aF.fields.sample + "\ncaption=" + aF.fields.title + "\ntype=" + aF.fields.mimetype + "\n");
+      aDoc.add_boolean_term(aF.idterm);
+      aTg.set_document(aDoc);
+      indexFields(aTg, aF.fields, aData->fieldmap);
+      if (aData->md5slot != Xapian::BAD_VALUENO)
+        aDoc.add_value(aData->md5slot, aF.fields.md5);
     }
-    if (!aData->fields.keywords.empty()) {
-      aData->termgen->mTg.index_text(aData->fields.keywords);
-      aData->termgen->mTg.increase_termpos();
+    if (aData->mtimeslot != Xapian::BAD_VALUENO)
+      aDoc.add_value(aData->mtimeslot, Xapian::sortable_serialise(aF.mtime));
+    if (aData->sizeslot != Xapian::BAD_VALUENO)
+      aDoc.add_value(aData->sizeslot, Xapian::sortable_serialise(aF.size));
+    aDb.replace_document(aF.idterm, aDoc);
+    ++(aSame ? aData->updated : aData->indexed);
+    std::string().swap(aF.fields.dump);
+    std::string().swap(aF.fields.sample);
+  }
+  if (aData->commit)
+    aDb.commit();
+  } catch (const Xapian::Error& err) {
+    aData->error = new Xapian::Error(err);
+  }
+
+  return 0;
+}
+
+int WritableDatabase::IndexBatch_done(eio_req *req) {
+  HandleScope scope;
+
+  IndexStep_data* aStep = (IndexStep_data*) req->data;
+  IndexDirectory_data* aData = aStep->group;
+  aData->indexing = false;
+  delete aStep;
+  if (!aData->error)
+    IndexDirectory_progress(aData, "index");
+  IndexDirectory_next(aData);
+
+  return 0;
+}
+
+// keeps up to parallel conversions running and one batch writing; finishes
+// the op when both are idle. Converted text waits in memory for a batch, so
+// conversion pauses while two batches' worth is ready or converting.
+void WritableDatabase::IndexDirectory_next(IndexDirectory_data* data) {
+  if (data->error)
+    data->nextconvert = data->files.size();
+  while (data->converting < data->parallel && data->nextconvert < data->files.size()
+         && data->ready.size() + data->converting < 2 * data->batchsize) {
+    IndexStep_data* aStep = new IndexStep_data;
+    aStep->group = data;
+    aStep->items.push_back(data->nextconvert++);
+    if (data->converters.empty()) {
+      aStep->converter = new Xapian::Mime2Text(data->mime2text->m2T); // convert() isn't safe to share
+    } else {
+      aStep->converter = data->converters.back();
+      data->converters.pop_back();
     }
-    if (!aData->fields.dump.empty()) {
-      aData->termgen->mTg.index_text(aData->fields.dump);
-      aData->termgen->mTg.increase_termpos();
+    ++data->converting;
+    sExecutor.submit(IndexConvert_pool, IndexConvert_done, aStep);
+  }
+  bool aAllConverted = data->nextconvert == data->files.size() && data->converting == 0;
+  if (!data->indexing && !data->error && data->ready.size() && (data->ready.size() >= data->batchsize || aAllConverted)) {
+    IndexStep_data* aStep = new IndexStep_data;
+    aStep->group = data;
+    size_t aN = std::min(data->ready.size(), data->batchsize);
+    aStep->items.assign(data->ready.begin(), data->ready.begin() + aN);
+    data->ready.erase(data->ready.begin(), data->ready.begin() + aN);
+    data->indexing = true;
+    sExecutor.submit(IndexBatch_pool, IndexBatch_done, aStep);
+    return;
+  }
+  if (data->indexing || !aAllConverted || (data->ready.size() && !data->error))
+    return;
+
+  Handle<Value> argv[2];
+  if (data->error) {
+    argv[0] = Exception::Error(String::New(data->error->get_msg().c_str()));
+  } else {
+    argv[0] = Null();
+    Local<Object> aInfo = IndexDirectory_info(data);
+    aInfo->Set(String::NewSymbol("seconds"), Number::New(nowSeconds() - data->started));
+    Local<Array> aErrors(Array::New(data->errors.size()));
+    for (size_t a = 0; a < data->errors.size(); ++a)
+      aErrors->Set(a, String::New(data->errors[a].data(), data->errors[a].size()));
+    aInfo->Set(String::NewSymbol("errors"), aErrors);
+    argv[1] = aInfo;
+  }
+  tryCallCatch(data->callback, data->object->handle_, data->error ? 1 : 2, argv);
+  delete data;
+}
+
+Local<Object> WritableDatabase::IndexDirectory_info(IndexDirectory_data* data) {
+  Local<Object> aO(Object::New());
+  aO->Set(String::NewSymbol("files"    ), Number::New(data->seen     ));
+  aO->Set(String::NewSymbol("unchanged"), Number::New(data->unchanged));
+  aO->Set(String::NewSymbol("indexed"  ), Number::New(data->indexed  ));
+  aO->Set(String::NewSymbol("updated"  ), Number::New(data->updated  ));
+  aO->Set(String::NewSymbol("failed"   ), Number::New(data->failed   ));
+  aO->Set(String::NewSymbol("deleted"  ), Number::New(data->deleted  ));
+  aO->Set(String::NewSymbol("pending"), Number::New(data->files.size() - data->nextconvert + data->converting + data->ready.size()));
+  return aO;
+}
+
+void WritableDatabase::IndexDirectory_progress(IndexDirectory_data* data, const char* phase) {
+  if (data->progress.IsEmpty())
+    return;
+  Local<Object> aO = IndexDirectory_info(data);
+  aO->Set(String::NewSymbol("phase"), String::New(phase));
+  Handle<Value> argv[] = { aO };
+  tryCallCatch(data->progress, data->object->handle_, 1, argv);
+}
+
+/*
+compact(sources, dest, options, function)
+  sources: [ path, ... ]
+  dest: path
+  options: {
+    // all members optional
+    compaction: number, // compact.STANDARD, compact.FULL (default), or compact.FULLER
+    multipass: boolean, // merge postlists in passes; faster with many sources
+    block_size: number, // bytes, for the new tables
+    renumber: boolean, // default true; false preserves docids, which must not overlap
+    open: boolean, // return a Database opened on dest
+    progress: function(status) // called with { table: string, status: string }
+  }
+  function(err, db) // db is undefined unless options.open
+*/
+
+static Handle<Value> Compact(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() < 4 || !args[0]->IsArray() || !args[1]->IsString() || !args[2]->IsObject() || !args[3]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("arguments are (array, string, object, function)")));
+
+  Local<Array> aSources = Local<Array>::Cast(args[0]);
+  if (aSources->Length() == 0)
+    return ThrowException(Exception::TypeError(String::New("sources list is empty")));
+  for (uint32_t a = 0; a < aSources->Length(); ++a)
+    if (!aSources->Get(a)->IsString())
+      return ThrowException(Exception::TypeError(String::New("sources list member not a string")));
+
+  Local<Object> aO = args[2]->ToObject();
+  Local<String> aKey;
+  Local<Value> aVal, aProgress;
+  Xapian::Compactor::compaction_level aLevel = Xapian::Compactor::FULL;
+  size_t aBlockSize = 0;
+  bool aMultipass = false, aRenumber = true, aOpen = false;
+  if (aO->Has(aKey = String::New("compaction"))) {
+    aVal = aO->Get(aKey);
+    if (!aVal->IsUint32() || aVal->Uint32Value() > Xapian::Compactor::FULLER)
+      return ThrowException(Exception::TypeError(String::New("options object compaction not a compact level")));
+    aLevel = (Xapian::Compactor::compaction_level) aVal->Uint32Value();
+  }
+  if (aO->Has(aKey = String::New("block_size"))) {
+    aVal = aO->Get(aKey);
+    if (!aVal->IsUint32())
+      return ThrowException(Exception::TypeError(String::New("options object block_size not a number")));
+    aBlockSize = aVal->Uint32Value();
+  }
+  const char* aFlags[] = { "multipass", "renumber", "open" };
+  bool* aFlagOpts[] = { &aMultipass, &aRenumber, &aOpen };
+  for (int a = 0; a < 3; ++a) {
+    if (aO->Has(aKey = String::New(aFlags[a]))) {
+      aVal = aO->Get(aKey);
+      if (!aVal->IsBoolean())
+        return ThrowException(Exception::TypeError(String::Concat(String::New("options object member not a boolean: "), aKey)));
+      *aFlagOpts[a] = aVal->BooleanValue();
     }
   }
+  if (aO->Has(aKey = String::New("progress"))) {
+    aProgress = aO->Get(aKey);
+    if (!aProgress->IsFunction())
+      return ThrowException(Exception::TypeError(String::New("options object progress not a function")));
+  }
+
+  Compact_data* aData = new Compact_data(Local<Function>::Cast(args[3]), args[1]);
+  for (uint32_t a = 0; a < aSources->Length(); ++a)
+    aData->sources.push_back(*String::Utf8Value(aSources->Get(a)));
+  aData->blocksize = aBlockSize;
+  aData->level = aLevel;
+  aData->multipass = aMultipass;
+  aData->renumber = aRenumber;
+  aData->open = aOpen;
+  if (!aProgress.IsEmpty())
+    aData->progress = new ProgressQueue(Local<Function>::Cast(aProgress));
+
+  sExecutor.submit(Compact_pool, Compact_done, aData);
+
+  return Undefined();
+}
+
+struct CompactStatus : public Xapian::Compactor {
+  CompactStatus(ProgressQueue* pq) : Xapian::Compactor(), progress(pq) {}
+  void set_status(const std::string& table, const std::string& status) {
+    if (!progress)
+      return;
+    ProgressQueue::Record aRec;
+    aRec.strings.push_back(std::make_pair("table", table));
+    aRec.strings.push_back(std::make_pair("status", status));
+    progress->push(aRec);
+  }
+  ProgressQueue* progress;
+};
+
+static int Compact_pool(eio_req *req) {
+  Compact_data* aData = (Compact_data*) req->data;
+
+  try {
+  CompactStatus aCompactor(aData->progress);
+  if (aData->blocksize)
+    aCompactor.set_block_size(aData->blocksize);
+  aCompactor.set_compaction_level(aData->level);
+  aCompactor.set_multipass(aData->multipass);
+  aCompactor.set_renumber(aData->renumber);
+  aCompactor.set_destdir(*aData->destdir);
+  for (size_t a = 0; a < aData->sources.size(); ++a)
+    aCompactor.add_source(aData->sources[a]);
+  aCompactor.compact();
+  if (aData->open)
+    aData->db = new Xapian::Database(*aData->destdir);
   } catch (const Xapian::Error& err) {
     aData->error = new Xapian::Error(err);
   }
@@ -1184,26 +5014,133 @@ static int Main_pool(eio_req *req) {
   return 0;
 }
 
-static int Main_done(eio_req *req) {
+static int Compact_done(eio_req *req) {
   HandleScope scope;
 
-  Main_data* aData = (Main_data*) req->data;
+  Compact_data* aData = (Compact_data*) req->data;
+
+  if (aData->progress)
+    aData->progress->flush();
 
   Handle<Value> argv[2];
   if (aData->error) {
     argv[0] = Exception::Error(String::New(aData->error->get_msg().c_str()));
-    delete aData->document;
   } else {
     argv[0] = Null();
-    Local<Value> aDoc[] = { External::New(aData->document) };
-    argv[1] = Document::constructor_template->GetFunction()->NewInstance(1, aDoc);
+    if (aData->db) {
+      argv[1] = Database::NewInstance(aData->db, std::vector<std::string>(1, *aData->destdir));
+      aData->db = NULL;
+    }
   }
 
-  tryCallCatch(aData->callback, Context::GetCurrent()->Global(), aData->error ? 1 : 2, argv);
+  tryCallCatch(aData->callback, Context::GetCurrent()->Global(), argv[1].IsEmpty() ? 1 : 2, argv);
 
   delete aData;
 
   return 0;
 }
 
+static Handle<Value> MemoryStats(const Arguments& args) {
+  HandleScope scope;
+
+  Local<Object> aStats(Object::New());
+  double aTotal = 0;
+  for (int a = 0; a < eMemTypes; ++a) {
+    Local<Object> aO(Object::New());
+    aO->Set(String::NewSymbol("count"), Number::New(sMemUsage[a].count));
+    aO->Set(String::NewSymbol("bytes"), Number::New(sMemUsage[a].bytes));
+    aO->Set(String::NewSymbol("peak" ), Number::New(sMemUsage[a].peak ));
+    aStats->Set(String::NewSymbol(kMemTypeNames[a]), aO);
+    aTotal += sMemUsage[a].bytes;
+  }
+  aStats->Set(String::NewSymbol("total"), Number::New(aTotal));
+  aStats->Set(String::NewSymbol("limit"), Number::New(sOpMemoryLimit));
+  return scope.Close(aStats);
+}
+
+static Handle<Value> SetMemoryLimit(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() < 1 || !args[0]->IsNumber() || args[0]->NumberValue() < 0)
+    return ThrowException(Exception::TypeError(String::New("arguments are (number)")));
+
+  sOpMemoryLimit = (size_t) args[0]->NumberValue();
+  return Undefined();
+}
+
+/*
+pool options object
+  threads: number  // worker threads, default 4
+  affinity: boolean | [cpu, ...]  // true pins worker n to cpu n; a list is used round-robin
+*/
+
+static Handle<Value> SetPoolOptions(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() < 1 || !args[0]->IsObject())
+    return ThrowException(Exception::TypeError(String::New("arguments are (object)")));
+  if (sExecutor.started)
+    return ThrowException(Exception::Error(String::New("pool options must be set before the first async op")));
+
+  Local<Object> aOpt = args[0]->ToObject();
+  Local<String> aKey;
+  size_t aThreads = sExecutor.threads;
+  std::vector<int> aCpus;
+  if (aOpt->Has(aKey = String::New("threads"))) {
+    Local<Value> aVal = aOpt->Get(aKey);
+    if (!aVal->IsUint32() || aVal->Uint32Value() == 0)
+      return ThrowException(Exception::TypeError(String::New("options object threads not a positive integer")));
+    aThreads = aVal->Uint32Value();
+  }
+  if (aOpt->Has(aKey = String::New("affinity"))) {
+    Local<Value> aVal = aOpt->Get(aKey);
+    if (aVal->IsArray()) {
+      Local<Array> aAry = Local<Array>::Cast(aVal);
+      for (uint32_t a = 0; a < aAry->Length(); ++a) {
+        if (!aAry->Get(a)->IsUint32())
+          return ThrowException(Exception::TypeError(String::New("options object affinity not an array of cpu numbers")));
+        aCpus.push_back(aAry->Get(a)->Uint32Value());
+      }
+    } else if (aVal->IsBoolean()) {
+      if (aVal->BooleanValue()) {
+        long aN = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long a = 0; a < aN; ++a)
+          aCpus.push_back(a);
+      }
+    } else {
+      return ThrowException(Exception::TypeError(String::New("options object affinity not a boolean or array")));
+    }
+  } else {
+    aCpus = sExecutor.cpus;
+  }
+
+  sExecutor.threads = aThreads;
+  sExecutor.cpus.swap(aCpus);
+  return Undefined();
+}
+
+static Handle<Value> PoolStats(const Arguments& args) {
+  HandleScope scope;
 
+  Local<Object> aStats(Object::New());
+  Local<Array> aWorkers(Array::New(sExecutor.workers.size()));
+  for (size_t a = 0; a < sExecutor.workers.size(); ++a) {
+    Executor::Worker* aW = sExecutor.workers[a];
+    Local<Object> aO(Object::New());
+    pthread_mutex_lock(&aW->lock);
+    aO->Set(String::NewSymbol("queued"  ), Number::New(aW->jobs.size()));
+    aO->Set(String::NewSymbol("executed"), Number::New(aW->executed   ));
+    aO->Set(String::NewSymbol("stolen"  ), Number::New(aW->stolen     ));
+    pthread_mutex_unlock(&aW->lock);
+    aO->Set(String::NewSymbol("cpu"), Integer::New(aW->cpu));
+    aWorkers->Set(a, aO);
+  }
+  pthread_mutex_lock(&sExecutor.idlelock);
+  aStats->Set(String::NewSymbol("queued"     ), Number::New(sExecutor.queued    ));
+  aStats->Set(String::NewSymbol("peak_queued"), Number::New(sExecutor.peakqueued));
+  pthread_mutex_unlock(&sExecutor.idlelock);
+  aStats->Set(String::NewSymbol("threads"  ), Number::New(sExecutor.threads  ));
+  aStats->Set(String::NewSymbol("completed"), Number::New(sExecutor.completed));
+  aStats->Set(String::NewSymbol("workers"), aWorkers);
+  return scope.Close(aStats);
+}